@@ -0,0 +1,105 @@
+/* Dispatch benchmark
+ *
+ * Usage: dispbench program [runs]
+ *        dispbench-switch program [runs]
+ *
+ * Runs a program compiled by kplc several times with its input and
+ * output tied to /dev/null, and reports the best time per run and per
+ * dispatched instruction: on the loaded code, on its direct-threaded
+ * translation, whose cost is reported on its own, and on the threaded
+ * code with the top of the stack cached in a register.
+ * dispbench uses computed goto dispatch and dispbench-switch the
+ * portable switch; compare the two on the workloads in this directory
+ * (kplc sum.kpl sum, and so on).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "instructions.h"
+#include "vm.h"
+
+double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Runs the threaded code, or the plain code if there is none
+double run(char* name, char* mode, VM* vm, CodeBlock* codeBlock, ThreadedCode* threadedCode, int runs) {
+  double start, t, best = 0;
+  enum VMStatus status;
+  int i;
+
+  for (i = 0; i < runs; i ++) {
+    start = now();
+    if (threadedCode != NULL)
+      status = runThreaded(vm, threadedCode);
+    else status = runCode(vm, codeBlock);
+    t = now() - start;
+    if (status != VM_HALTED) {
+      printf("%s: %s\n", name, vmStatusMessage(status));
+      exit(-1);
+    }
+    if (i == 0 || t < best) best = t;
+  }
+
+  printf("%-14s %-14s %-9s %12lld dispatches %8.3f s %6.2f ns/dispatch\n",
+	 name, vmDispatchMethod(), mode, vm->dispatches, best, best * 1e9 / vm->dispatches);
+  return best;
+}
+
+int main(int argc, char *argv[]) {
+  CodeBlock* codeBlock;
+  ThreadedCode* threadedCode;
+  VM* vm;
+  FILE* f;
+  double start, translation;
+  int runs = 5;
+
+  if (argc < 2) {
+    printf("Usage: %s program [runs]\n", argv[0]);
+    return -1;
+  }
+  if (argc > 2) runs = atoi(argv[2]);
+
+  f = fopen(argv[1], "rb");
+  if (f == NULL) {
+    printf("Can\'t read %s\n", argv[1]);
+    return -1;
+  }
+  codeBlock = createCodeBlock(1);
+  if (!loadCode(codeBlock, f)) {
+    printf("Invalid code file %s\n", argv[1]);
+    return -1;
+  }
+  fclose(f);
+
+  vm = createVM(DEFAULT_STACK_SIZE);
+  vm->input = fopen("/dev/null", "r");
+  vm->output = fopen("/dev/null", "w");
+
+  run(argv[1], "plain", vm, codeBlock, NULL, runs);
+
+  start = now();
+  threadedCode = translateCode(codeBlock, 0);
+  translation = now() - start;
+  if (threadedCode == NULL) {
+    printf("Invalid code file %s\n", argv[1]);
+    return -1;
+  }
+  run(argv[1], "threaded", vm, codeBlock, threadedCode, runs);
+  printf("%-14s translation of %d instructions %.3f ms\n", 
+	 argv[1], codeBlock->codeSize, translation * 1e3);
+  freeThreadedCode(threadedCode);
+
+  threadedCode = translateCode(codeBlock, 1);
+  run(argv[1], "cached", vm, codeBlock, threadedCode, runs);
+  freeThreadedCode(threadedCode);
+  fclose(vm->input);
+  fclose(vm->output);
+  freeVM(vm);
+  freeCodeBlock(codeBlock);
+  return 0;
+}
@@ -0,0 +1,91 @@
+/* Keyword recognition benchmark
+ *
+ * Usage: kwbench [identifiers]
+ *
+ * Builds a corpus of upper-case identifiers (one in four of them a
+ * keyword) and classifies every entry with the old linear keyword scan
+ * and with checkKeyword().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "token.h"
+
+#define DEFAULT_CORPUS_SIZE 1000000
+#define ROUNDS 10
+
+char *linearKeywords[KEYWORDS_COUNT] = {
+  "PROGRAM", "CONST", "TYPE", "VAR", "INTEGER", "CHAR", "ARRAY", "OF", "FUNCTION", "PROCEDURE",
+  "BEGIN", "END", "CALL", "IF", "THEN", "ELSE", "WHILE", "DO", "FOR", "TO"
+};
+
+TokenType linearTypes[KEYWORDS_COUNT] = {
+  KW_PROGRAM, KW_CONST, KW_TYPE, KW_VAR, KW_INTEGER, KW_CHAR, KW_ARRAY, KW_OF, KW_FUNCTION, KW_PROCEDURE,
+  KW_BEGIN, KW_END, KW_CALL, KW_IF, KW_THEN, KW_ELSE, KW_WHILE, KW_DO, KW_FOR, KW_TO
+};
+
+double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The lookup before the perfect hash
+TokenType linearCheckKeyword(char *string) {
+  int i;
+  for (i = 0; i < KEYWORDS_COUNT; i++)
+    if (strcmp(linearKeywords[i], string) == 0)
+      return linearTypes[i];
+  return TK_NONE;
+}
+
+void makeIdent(char *buffer) {
+  int len = 1 + rand() % 10;
+  int i;
+
+  buffer[0] = 'A' + rand() % 26;
+  for (i = 1; i < len; i++)
+    buffer[i] = (rand() % 4 == 0) ? '0' + rand() % 10 : 'A' + rand() % 26;
+  buffer[len] = '\0';
+}
+
+int main(int argc, char *argv[]) {
+  int size = argc > 1 ? atoi(argv[1]) : DEFAULT_CORPUS_SIZE;
+  char (*corpus)[MAX_IDENT_LEN + 1] = malloc(size * sizeof(*corpus));
+  long sum1 = 0, sum2 = 0;
+  double start, t1, t2;
+  int i, r;
+
+  srand(2008);
+  for (i = 0; i < size; i++) {
+    if (rand() % 4 == 0)
+      strcpy(corpus[i], linearKeywords[rand() % KEYWORDS_COUNT]);
+    else makeIdent(corpus[i]);
+  }
+
+  start = now();
+  for (r = 0; r < ROUNDS; r++)
+    for (i = 0; i < size; i++)
+      sum1 += linearCheckKeyword(corpus[i]);
+  t1 = now() - start;
+
+  start = now();
+  for (r = 0; r < ROUNDS; r++)
+    for (i = 0; i < size; i++)
+      sum2 += checkKeyword(corpus[i]);
+  t2 = now() - start;
+
+  if (sum1 != sum2) {
+    printf("kwbench: lookups disagree\n");
+    return -1;
+  }
+
+  printf("corpus: %d identifiers x %d rounds\n", size, ROUNDS);
+  printf("linear:  %6.1f ns/ident\n", t1 * 1e9 / ((double) size * ROUNDS));
+  printf("hashed:  %6.1f ns/ident\n", t2 * 1e9 / ((double) size * ROUNDS));
+  free(corpus);
+  return 0;
+}
@@ -0,0 +1,119 @@
+/* Reader throughput benchmark
+ *
+ * Usage: readbench [megabytes]
+ *
+ * Writes a synthetic KPL source of the given size and reads it back
+ * character by character, once through a getc() loop equivalent to the
+ * old readChar() and once through the in-memory reader.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "reader.h"
+
+#define DEFAULT_SIZE_MB 64
+
+char *sampleLines[] = {
+  "  For i := 1 To n Do\n",
+  "    S := S + A(.i.) * 2; (* accumulate *)\n",
+  "  If (n - (n/2) * 2) = 0 Then Call WriteC('E') Else Call WriteC('O');\n",
+  "  While i <= n Do Begin S := S + i; i := i + 1 End;\n"
+};
+
+double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+long makeInput(char *fileName, long size) {
+  FILE *f = fopen(fileName, "wb");
+  long written = 0;
+  int i = 0;
+
+  if (f == NULL) return -1;
+  fputs("Program Bench;\nVar n : Integer; i : Integer; S : Integer;\nBegin\n", f);
+  while (written < size) {
+    fputs(sampleLines[i], f);
+    written += strlen(sampleLines[i]);
+    i = (i + 1) % 4;
+  }
+  fputs("End.\n", f);
+  fclose(f);
+  return written;
+}
+
+// The reader before the in-memory rewrite
+long getcRead(char *fileName) {
+  FILE *f = fopen(fileName, "rt");
+  int ch, line = 1, col = 0;
+  long count = 0;
+
+  if (f == NULL) return -1;
+  do {
+    ch = getc(f);
+    col ++;
+    if (ch == '\n') {
+      line ++;
+      col = 0;
+    }
+    count ++;
+  } while (ch != EOF);
+  fclose(f);
+  return count + line;
+}
+
+long memoryRead(char *fileName) {
+  long count = 1;   // openInputStream() has already read the first character
+
+  if (openInputStream(fileName) == IO_ERROR) return -1;
+  while (currentChar != EOF) {
+    readChar();
+    count ++;
+  }
+  closeInputStream();
+  return count + lineNo;
+}
+
+int main(int argc, char *argv[]) {
+  char fileName[] = "/tmp/readbenchXXXXXX";
+  long size = (argc > 1 ? atol(argv[1]) : DEFAULT_SIZE_MB) * 1024 * 1024;
+  double start, t1, t2;
+  long r1, r2;
+  int fd;
+
+  fd = mkstemp(fileName);
+  if (fd < 0) {
+    printf("readbench: cannot create temporary file\n");
+    return -1;
+  }
+  close(fd);
+  size = makeInput(fileName, size);
+
+  // Warm the page cache so both readers see the same conditions
+  getcRead(fileName);
+
+  start = now();
+  r1 = getcRead(fileName);
+  t1 = now() - start;
+
+  start = now();
+  r2 = memoryRead(fileName);
+  t2 = now() - start;
+
+  unlink(fileName);
+
+  if (r1 != r2) {
+    printf("readbench: readers disagree (%ld vs %ld)\n", r1, r2);
+    return -1;
+  }
+
+  printf("input:  %.1f MB\n", size / 1048576.0);
+  printf("getc:   %8.1f MB/s\n", size / 1048576.0 / t1);
+  printf("memory: %8.1f MB/s\n", size / 1048576.0 / t2);
+  return 0;
+}
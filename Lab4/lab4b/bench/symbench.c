@@ -0,0 +1,77 @@
+/* Symbol table scaling benchmark
+ *
+ * Usage: symbench
+ *
+ * Declares 1k, 10k and 100k variables in one scope, checking each name
+ * for freshness first the way the parser does, then looks every name
+ * up again.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "symtab.h"
+#include "intern.h"
+
+extern SymTab* symtab;
+
+double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void run(int n) {
+  char **names = (char**) malloc(n * sizeof(char*));
+  char buffer[MAX_IDENT_LEN + 1];
+  double start, tDeclare, tLookup;
+  Object* obj;
+  int i, len, found = 0;
+
+  initSymTab();
+  for (i = 0; i < n; i++) {
+    len = sprintf(buffer, "V%d", i);
+    names[i] = internString(buffer, len);
+  }
+
+  obj = createProgramObject(internString("BENCH", 5));
+  enterBlock(obj->progAttrs->scope);
+
+  start = now();
+  for (i = 0; i < n; i++) {
+    if (findObject(symtab->currentScope, names[i]) != NULL) {
+      printf("symbench: duplicate %s\n", names[i]);
+      exit(-1);
+    }
+    obj = createVariableObject(names[i]);
+    obj->varAttrs->type = makeIntType();
+    declareObject(obj);
+  }
+  tDeclare = now() - start;
+
+  start = now();
+  for (i = 0; i < n; i++)
+    if (findObject(symtab->currentScope, names[i]) != NULL)
+      found ++;
+  tLookup = now() - start;
+
+  exitBlock();
+  cleanSymTab();
+  cleanInternTable();
+  free(names);
+
+  if (found != n) {
+    printf("symbench: %d of %d names found\n", found, n);
+    exit(-1);
+  }
+  printf("%7d decls: declare %8.3f ms, lookup %8.3f ms (%5.1f ns/lookup)\n",
+	 n, tDeclare * 1e3, tLookup * 1e3, tLookup * 1e9 / n);
+}
+
+int main(void) {
+  run(1000);
+  run(10000);
+  run(100000);
+  return 0;
+}
@@ -0,0 +1,60 @@
+/* 
+ * @copyright (c) 2008, Hedspi, Hanoi University of Technology
+ * @author Huu-Duc Nguyen
+ * @version 1.0
+ */
+
+#include <stdlib.h>
+#include "arena.h"
+
+#define ARENA_ALIGN 16
+#define ALIGN_UP(n) (((n) + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1))
+#define CHUNK_HEADER ALIGN_UP(sizeof(ArenaChunk))
+
+ArenaStats arenaStats;
+
+Arena* createArena(void) {
+  Arena* arena = (Arena*) malloc(sizeof(Arena));
+  arena->chunks = NULL;
+  return arena;
+}
+
+ArenaChunk* newChunk(Arena* arena, size_t size) {
+  ArenaChunk* chunk = (ArenaChunk*) malloc(CHUNK_HEADER + size);
+  if (chunk == NULL) {
+    abort();
+  }
+  chunk->size = size;
+  chunk->used = 0;
+  chunk->next = arena->chunks;
+  arena->chunks = chunk;
+  arenaStats.chunks ++;
+  arenaStats.reserved += CHUNK_HEADER + size;
+  return chunk;
+}
+
+void* arenaAlloc(Arena* arena, size_t size) {
+  ArenaChunk* chunk = arena->chunks;
+  void* p;
+
+  size = ALIGN_UP(size);
+  if ((chunk == NULL) || (chunk->used + size > chunk->size))
+    chunk = newChunk(arena, size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE);
+
+  p = (char*) chunk + CHUNK_HEADER + chunk->used;
+  chunk->used += size;
+  arenaStats.allocations ++;
+  arenaStats.bytes += size;
+  return p;
+}
+
+void freeArena(Arena* arena) {
+  ArenaChunk* chunk = arena->chunks;
+
+  while (chunk != NULL) {
+    ArenaChunk* next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  free(arena);
+}
@@ -0,0 +1,46 @@
+/* 
+ * @copyright (c) 2008, Hedspi, Hanoi University of Technology
+ * @author Huu-Duc Nguyen
+ * @version 1.0
+ */
+
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stddef.h>
+
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+struct ArenaChunk_ {
+  struct ArenaChunk_ *next;
+  size_t size;
+  size_t used;
+};
+
+typedef struct ArenaChunk_ ArenaChunk;
+
+// A bump allocator. Objects are never freed one by one; the whole arena
+// is released at once with freeArena().
+struct Arena_ {
+  ArenaChunk *chunks;
+};
+
+typedef struct Arena_ Arena;
+
+// Totals over every arena since the start of the program
+struct ArenaStats_ {
+  long allocations;       // arenaAlloc calls
+  long chunks;            // malloc calls made on behalf of the arenas
+  size_t bytes;           // bytes handed out
+  size_t reserved;        // bytes obtained from malloc
+};
+
+typedef struct ArenaStats_ ArenaStats;
+
+extern ArenaStats arenaStats;
+
+Arena* createArena(void);
+void* arenaAlloc(Arena* arena, size_t size);
+void freeArena(Arena* arena);
+
+#endif
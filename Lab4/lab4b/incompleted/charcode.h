@@ -29,4 +29,6 @@ typedef enum {
   CHAR_UNKNOWN
 } CharCode;
 
+#define UPPER_CASE(ch) ((((ch) >= 'a') && ((ch) <= 'z')) ? ((ch) - 'a' + 'A') : (ch))
+
 #endif
@@ -6,11 +6,22 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
 #include "reader.h"
 #include "codegen.h"  
+#include "peephole.h"
+#include "error.h"
+
+#define INITIAL_CODE_SIZE 1024
+
+// Emission only fails when the code buffer cannot grow any further
+#define EMIT(e) do { if (genLineInfo) recordLine();				\
+    if (!(e)) error(ERR_CODE_TOO_LARGE, currentToken->lineNo, currentToken->colNo); } while (0)
 
-#define CODE_SIZE 10000
 extern SymTab* symtab;
+extern Token* currentToken;
 
 extern Object* readiFunction;
 extern Object* readcFunction;
@@ -20,26 +31,60 @@ extern Object* writelnProcedure;
 
 CodeBlock* codeBlock;
 
+int outputFormat = FORMAT_BARE;
+int genLineInfo = 0;
+int optimizations = 0;
+
+// The last address handed out by getCurrentCodeAddress
+CodeAddress lastLabel = 0;
+
+// The INT of the frame being compiled, and the slots FOR loops took in it
+CodeAddress frameInst = 0;
+int firstSlot = 0;
+int numOfSlots = 0;
+int usedSlots = 0;
+
+// The levels whose frames inner procedures reached through the display
+int displayUsed[DISPLAY_SIZE];
+
+// Procedures in declaration order, for lambda lifting
+LiftedProcedure* liftedProcedures = NULL;
+int numOfLiftedProcedures = 0;
+int maxLiftedProcedures = 0;
+int numOfProcedures = 0;   // declared so far in this pass
+int liftingPass = FALSE;   // the second pass, once liftProcedures has run
+
+// The FOR loops around the code being compiled, innermost last
+ForLoop forLoops[MAX_FOR_LOOPS];
+int numOfForLoops = 0;
+
+ForLoop* slotOwner(Instruction* inst);
+int liftedAccess(int level, int offset, int address);
+
+void recordLine(void) {
+  if (!addLineEntry(codeBlock, codeBlock->codeSize, currentToken->lineNo))
+    error(ERR_CODE_TOO_LARGE, currentToken->lineNo, currentToken->colNo);
+}
+
+// The number of scopes around scope; the program is at level 0
+int scopeLevel(Scope* scope) {
+  int level = 0;
+
+  for (scope = scope->outer; scope != NULL; scope = scope->outer)
+    level ++;
+  return level;
+}
+
+int levelDifference(Scope* scope) {
+  return scopeLevel(symtab->currentScope) - scopeLevel(scope);
+}
+
 void genVariableAddress(Object* var) {
-  int level = 0, varLevel = 0;
-  if (symtab->currentScope->outer != NULL) {
-    level = 1;
-  } 
-  if (VARIABLE_SCOPE(var)->outer != NULL) {
-    varLevel = 1;
-  }
-  genLA(level - varLevel, VARIABLE_OFFSET(var));
+  genLA(levelDifference(VARIABLE_SCOPE(var)), VARIABLE_OFFSET(var));
 }
 
 void genVariableValue(Object* var) {
-  int level = 0, varLevel = 0;
-  if (symtab->currentScope->outer != NULL) {
-    level = 1;
-  } 
-  if (VARIABLE_SCOPE(var)->outer != NULL) {
-    varLevel = 1;
-  }
-  genLV(level - varLevel, VARIABLE_OFFSET(var));
+  genLV(levelDifference(VARIABLE_SCOPE(var)), VARIABLE_OFFSET(var));
 }
 
 int isPredefinedFunction(Object* func) {
@@ -66,145 +111,1142 @@ void genPredefinedFunctionCall(Object* func) {
     genRC();
 }
 
+/******************************************************************/
+
+// The last n instructions, if the optimization is on and no label falls
+// inside them or right after them
+Instruction* fusible(int optimization, int n) {
+  if (!(optimizations & optimization)) return NULL;
+  if (codeBlock->codeSize - n < 0 || codeBlock->codeSize - n < lastLabel) return NULL;
+  return codeBlock->code + codeBlock->codeSize - n;
+}
+
+// Line entries must not point past the code
+void trimLines(void) {
+  while (NUM_OF_LINES(codeBlock) > 0 && 
+	 LINE_ENTRY(codeBlock, NUM_OF_LINES(codeBlock) - 1)->codeAddress > codeBlock->codeSize)
+    codeBlock->lines.size -= sizeof(LineEntry);
+}
+
+void dropCode(int n) {
+  codeBlock->codeSize -= n;
+  trimLines();
+}
+
+// Removes one instruction from the middle of straight-line code
+void removeCode(CodeAddress at) {
+  int i;
+
+  memmove(codeBlock->code + at, codeBlock->code + at + 1, 
+	  (codeBlock->codeSize - at - 1) * sizeof(Instruction));
+  codeBlock->codeSize --;
+  if (lastLabel > at) lastLabel --;
+  for (i = 0; i < NUM_OF_LINES(codeBlock); i ++)
+    if (LINE_ENTRY(codeBlock, i)->codeAddress > at)
+      LINE_ENTRY(codeBlock, i)->codeAddress --;
+  trimLines();
+}
+
+/******************************************************************/
+
+// The operators as the machine computes them, wrapping around on overflow
+WORD evaluate(enum OpCode op, WORD x, WORD y) {
+  switch (op) {
+  case OP_AD: return (WORD) ((unsigned) x + (unsigned) y);
+  case OP_SB: return (WORD) ((unsigned) x - (unsigned) y);
+  case OP_ML: return (WORD) ((unsigned) x * (unsigned) y);
+  case OP_DV: return (y == -1) ? (WORD) (0u - (unsigned) x) : x / y;
+  default: return 0;
+  }
+}
+
+// Single instructions that only push a value, which identities may drop
+int isPure(Instruction* inst) {
+  return inst->op == OP_LC || inst->op == OP_LV;
+}
+
+void setConstant(Instruction* inst, WORD value) {
+  inst->op = OP_LC;
+  inst->p = DC_VALUE;
+  inst->q = value;
+}
+
+/* Folds the binary operator about to be emitted into its operands when
+ * they are constants, or applies x+0, x-0, 0+x, x*1, 1*x, x/1, x*0, 0*x
+ * and x-x. Returns TRUE if the operator needs no code any more. A
+ * constant division by zero is left for the machine to report. */
+int foldBinary(enum OpCode op) {
+  Instruction* last = fusible(OPT_FOLD, 1);
+  Instruction* prev = fusible(OPT_FOLD, 2);
+  WORD x, y;
+
+  if (last == NULL) return FALSE;
+
+  if (prev != NULL && prev[0].op == OP_LC && prev[1].op == OP_LC) {
+    x = prev[0].q;
+    y = prev[1].q;
+    if (op == OP_DV && y == 0) return FALSE;
+    setConstant(prev, evaluate(op, x, y));
+    dropCode(1);
+    return TRUE;
+  }
+
+  if (last->op == OP_LC) {
+    y = last->q;
+    if ((y == 0 && (op == OP_AD || op == OP_SB)) || 
+	(y == 1 && (op == OP_ML || op == OP_DV))) {
+      dropCode(1);
+      return TRUE;
+    }
+  }
+
+  if (prev != NULL && isPure(prev) && isPure(prev + 1)) {
+    if (prev[0].op == OP_LC && 
+	((prev[0].q == 0 && op == OP_AD) || (prev[0].q == 1 && op == OP_ML))) {
+      prev[0] = prev[1];
+      dropCode(1);
+      return TRUE;
+    }
+    if (op == OP_ML && ((prev[0].op == OP_LC && prev[0].q == 0) || 
+			(prev[1].op == OP_LC && prev[1].q == 0))) {
+      setConstant(prev, 0);
+      dropCode(1);
+      return TRUE;
+    }
+    if (op == OP_SB && prev[0].op == OP_LV && prev[1].op == OP_LV &&
+	prev[0].p == prev[1].p && prev[0].q == prev[1].q) {
+      setConstant(prev, 0);
+      dropCode(1);
+      return TRUE;
+    }
+  }
+
+  // x-x on a local, when superinstructions made it LV2 x,x
+  if (op == OP_SB && last->op == OP_LV2 && last->p == last->q) {
+    setConstant(last, 0);
+    return TRUE;
+  }
+  return FALSE;
+}
+
+// k if value is 2^k, otherwise -1
+int powerOfTwo(WORD value) {
+  int k;
+
+  for (k = 0; k < 31; k ++)
+    if (value == (1 << k)) return k;
+  return -1;
+}
+
+/* The magic number and shift that divide by d, for d >= 2, by a signed
+ * multiplication that keeps the high word (Hacker's Delight, 10-4) */
+void divisionMagic(WORD d, WORD* magic, int* shift) {
+  const unsigned two31 = 0x80000000u;
+  unsigned ad = (unsigned) d;
+  unsigned anc = two31 - 1 - two31 % ad;
+  unsigned q1 = two31 / anc, r1 = two31 - q1 * anc;
+  unsigned q2 = two31 / ad, r2 = two31 - q2 * ad;
+  unsigned delta;
+  int p = 31;
+
+  do {
+    p ++;
+    q1 = 2 * q1; r1 = 2 * r1;
+    if (r1 >= anc) { q1 ++; r1 -= anc; }
+    q2 = 2 * q2; r2 = 2 * r2;
+    if (r2 >= ad) { q2 ++; r2 -= ad; }
+    delta = ad - r2;
+  } while (q1 < delta || (q1 == delta && r1 == 0));
+
+  *magic = (WORD) (q2 + 1);
+  *shift = p - 32;
+}
+
+/* Multiplication and division by a constant: by 1 is dropped, by -1 is
+ * NEG, by a power of two is a shift, and division by any other positive
+ * constant is a multiplication by its magic number. Returns TRUE if the
+ * operator needs no code any more. */
+int reduceStrength(enum OpCode op) {
+  Instruction* last = fusible(OPT_STRENGTH, 1);
+  WORD magic;
+  int k;
+
+  if (last == NULL || last->op != OP_LC) return FALSE;
+  if (op != OP_ML && op != OP_DV) return FALSE;
+
+  if (last->q == 1) {
+    dropCode(1);
+    return TRUE;
+  }
+  if (last->q == -1) {
+    last->op = OP_NEG;
+    return TRUE;
+  }
+  k = powerOfTwo(last->q);
+  if (k > 0) {
+    last->op = (op == OP_ML) ? OP_SHL : OP_SHR;
+    last->q = k;
+    return TRUE;
+  }
+  if (op == OP_DV && last->q > 2) {
+    divisionMagic(last->q, &magic, &k);
+    last->op = OP_DVM;
+    last->p = k;
+    last->q = magic;
+    return TRUE;
+  }
+  return FALSE;
+}
+
+/******************************************************************/
+
+// Whether the frames of the current level are entered into the display
+int inDisplay(void) {
+  int level = scopeLevel(symtab->currentScope);
+
+  return (optimizations & OPT_DISPLAY) && level > 0 && level < DISPLAY_SIZE && displayUsed[level];
+}
+
+// The display level of the frame level static links out
+int displayLevel(int level) {
+  level = scopeLevel(symtab->currentScope) - level;
+  if (level < DISPLAY_SIZE) displayUsed[level] = TRUE;
+  return level;
+}
+
+void genFrame(void) {
+  if (inDisplay())
+    EMIT(emitDSP(codeBlock, scopeLevel(symtab->currentScope)));
+  frameInst = codeBlock->codeSize;
+  firstSlot = symtab->currentScope->frameSize;
+  numOfSlots = usedSlots = 0;
+  EMIT(emitINT(codeBlock, symtab->currentScope->frameSize));
+}
+
 void genLA(int level, int offset) {
-  emitLA(codeBlock, level, offset);
+  if (level > 0 && liftedAccess(level, offset, TRUE)) return;
+  if (level > 0 && (optimizations & OPT_DISPLAY))
+    EMIT(emitLAD(codeBlock, displayLevel(level), offset));
+  else EMIT(emitLA(codeBlock, level, offset));
 }
 
 void genLV(int level, int offset) {
-  emitLV(codeBlock, level, offset);
+  Instruction* prev = fusible(OPT_SUPER, 1);
+
+  if (level > 0 && liftedAccess(level, offset, FALSE)) return;
+  if (level > 0 && (optimizations & OPT_DISPLAY)) {
+    EMIT(emitLVD(codeBlock, displayLevel(level), offset));
+    return;
+  }
+
+  if (prev != NULL && prev->op == OP_LV && prev->p == 0 && level == 0) {
+    prev->op = OP_LV2;
+    prev->p = prev->q;
+    prev->q = offset;
+    return;
+  }
+  EMIT(emitLV(codeBlock, level, offset));
 }
 
 void genLC(WORD constant) {
-  emitLC(codeBlock, constant);
+  EMIT(emitLC(codeBlock, constant));
 }
 
 void genLI(void) {
-  emitLI(codeBlock);
+  Instruction* prev = fusible(OPT_SUPER, 1);
+
+  // An element address of a FOR loop, which stays apart from other code
+  if (prev == NULL && (optimizations & OPT_SUPER) && codeBlock->codeSize > 0 &&
+      slotOwner(codeBlock->code + codeBlock->codeSize - 1) != NULL)
+    prev = codeBlock->code + codeBlock->codeSize - 1;
+  if (prev != NULL && prev->op == OP_LV) {
+    prev->op = OP_LVI;
+    return;
+  }
+  if (prev != NULL && prev->op == OP_IXA) {
+    prev->op = OP_LIX;
+    return;
+  }
+  EMIT(emitLI(codeBlock));
 }
 
 void genINT(int delta) {
-  emitINT(codeBlock,delta);
+  EMIT(emitINT(codeBlock,delta));
 }
 
 void genDCT(int delta) {
-  emitDCT(codeBlock,delta);
+  EMIT(emitDCT(codeBlock,delta));
 }
 
-Instruction* genJ(CodeAddress label) {
-  Instruction* inst = codeBlock->code + codeBlock->codeSize;
-  emitJ(codeBlock,label);
+// Jumps are returned as code addresses rather than pointers, because the
+// code buffer moves when it grows.
+CodeAddress genJ(CodeAddress label) {
+  CodeAddress inst = codeBlock->codeSize;
+  EMIT(emitJ(codeBlock,label));
   return inst;
 }
 
-Instruction* genFJ(CodeAddress label) {
-  Instruction* inst = codeBlock->code + codeBlock->codeSize;
-  emitFJ(codeBlock, label);
+// A comparison followed by FJ becomes a single jump on the opposite
+// comparison. Either way the result is patched with updateFJ.
+CodeAddress genFJ(CodeAddress label) {
+  CodeAddress inst = codeBlock->codeSize;
+  Instruction* prev = fusible(OPT_BRANCH, 1);
+
+  if (prev != NULL) {
+    switch (prev->op) {
+    case OP_EQ: prev->op = OP_JNE; break;
+    case OP_NE: prev->op = OP_JEQ; break;
+    case OP_GT: prev->op = OP_JLE; break;
+    case OP_LT: prev->op = OP_JGE; break;
+    case OP_GE: prev->op = OP_JLT; break;
+    case OP_LE: prev->op = OP_JGT; break;
+    default: prev = NULL;
+    }
+    if (prev != NULL) {
+      prev->q = label;
+      return inst - 1;
+    }
+  }
+  EMIT(emitFJ(codeBlock, label));
+  return inst;
+}
+
+void genTJ(CodeAddress label) {
+  Instruction* prev = NULL;
+
+  // Conditions end with their comparison, which becomes the jump
+  if (codeBlock->codeSize > lastLabel)
+    prev = codeBlock->code + codeBlock->codeSize - 1;
+  if (prev != NULL) {
+    switch (prev->op) {
+    case OP_EQ: prev->op = OP_JEQ; break;
+    case OP_NE: prev->op = OP_JNE; break;
+    case OP_GT: prev->op = OP_JGT; break;
+    case OP_LT: prev->op = OP_JLT; break;
+    case OP_GE: prev->op = OP_JGE; break;
+    case OP_LE: prev->op = OP_JLE; break;
+    default: prev = NULL;
+    }
+    if (prev != NULL) {
+      prev->q = label;
+      return;
+    }
+  }
+  EMIT(emitFJ(codeBlock, codeBlock->codeSize + 2));
+  EMIT(emitJ(codeBlock, label));
+}
+
+CodeAddress genFORI(CodeAddress label) {
+  CodeAddress inst = codeBlock->codeSize;
+  EMIT(emitFORI(codeBlock, label));
   return inst;
 }
 
+void genFORN(CodeAddress label) {
+  EMIT(emitFORN(codeBlock, label));
+}
+
 void genHL(void) {
-  emitHL(codeBlock);
+  EMIT(emitHL(codeBlock));
 }
 
 void genST(void) {
-  emitST(codeBlock);
+  Instruction* prev = fusible(OPT_SUPER, 4);
+
+  // The increment of a FOR loop: CV; CV; LI; ADI q; ST
+  if (prev != NULL && prev[0].op == OP_CV && prev[1].op == OP_CV && 
+      prev[2].op == OP_LI && prev[3].op == OP_ADI) {
+    prev[0].op = OP_INC;
+    prev[0].q = prev[3].q;
+    dropCode(3);
+    return;
+  }
+  EMIT(emitST(codeBlock));
+}
+
+void genAssign(CodeAddress lvalue, CodeAddress expression) {
+  Instruction la;
+  Instruction* code;
+
+  // Only a plain variable, whose address is a single LA, becomes STV
+  if (!(optimizations & OPT_SUPER) || expression != lvalue + 1 ||
+      codeBlock->code[lvalue].op != OP_LA) {
+    genST();
+    return;
+  }
+
+  la = codeBlock->code[lvalue];
+  removeCode(lvalue);
+
+  // v := v + k on a local variable
+  code = codeBlock->code + lvalue;
+  if (la.p == 0 && codeBlock->codeSize == lvalue + 2 && 
+      code[0].op == OP_LV && code[0].p == 0 && code[0].q == la.q && code[1].op == OP_ADI) {
+    code[0].op = OP_INCL;
+    code[0].p = la.q;
+    code[0].q = code[1].q;
+    dropCode(1);
+    return;
+  }
+  EMIT(emitSTV(codeBlock, la.p, la.q));
 }
 
 void genCALL(int level, CodeAddress label) {
-  emitCALL(codeBlock, level, label);
+  if (optimizations & (OPT_DISPLAY | OPT_LIFT)) level = 0;
+  EMIT(emitCALL(codeBlock, level, label));
+}
+
+// Takes the frame out of the display again, see genFrame
+void leaveDisplay(void) {
+  int level = scopeLevel(symtab->currentScope);
+
+  if (!inDisplay()) return;
+  EMIT(emitDRS(codeBlock, level));
+  displayUsed[level] = FALSE;
 }
 
 void genEP(void) {
-  emitEP(codeBlock);
+  leaveDisplay();
+  EMIT(emitEP(codeBlock));
 }
 
 void genEF(void) {
-  emitEF(codeBlock);
+  leaveDisplay();
+  EMIT(emitEF(codeBlock));
 }
 
 void genRC(void) {
-  emitRC(codeBlock);
+  EMIT(emitRC(codeBlock));
 }
 
 void genRI(void) {
-  emitRI(codeBlock);
+  EMIT(emitRI(codeBlock));
 }
 
 void genWRC(void) {
-  emitWRC(codeBlock);
+  EMIT(emitWRC(codeBlock));
 }
 
 void genWRI(void) {
-  emitWRI(codeBlock);
+  EMIT(emitWRI(codeBlock));
 }
 
 void genWLN(void) {
-  emitWLN(codeBlock);
+  EMIT(emitWLN(codeBlock));
 }
 
 void genAD(void) {
-  emitAD(codeBlock);
+  Instruction* prev = fusible(OPT_SUPER, 1);
+  Instruction* pair = fusible(OPT_SUPER, 2);
+
+  if (foldBinary(OP_AD)) return;
+  // k + x is x + k for a single load
+  if (pair != NULL && pair[0].op == OP_LC && isPure(pair + 1)) {
+    Instruction constant = pair[0];
+    pair[0] = pair[1];
+    pair[1] = constant;
+  }
+  if (prev != NULL && prev->op == OP_LC) {
+    // x + j + k
+    if (pair != NULL && pair[0].op == OP_ADI && (optimizations & OPT_FOLD)) {
+      pair[0].q = evaluate(OP_AD, pair[0].q, prev->q);
+      dropCode(1);
+      return;
+    }
+    prev->op = OP_ADI;
+    return;
+  }
+  EMIT(emitAD(codeBlock));
 }
 
 void genSB(void) {
-  emitSB(codeBlock);
+  Instruction* prev = fusible(OPT_SUPER, 1);
+
+  if (foldBinary(OP_SB)) return;
+  if (prev != NULL && prev->op == OP_LC && prev->q != INT_MIN) {
+    prev->op = OP_ADI;
+    prev->q = - prev->q;
+    return;
+  }
+  EMIT(emitSB(codeBlock));
 }
 
 void genML(void) {
-  emitML(codeBlock);
+  if (foldBinary(OP_ML)) return;
+  if (reduceStrength(OP_ML)) return;
+  EMIT(emitML(codeBlock));
 }
 
 void genDV(void) {
-  emitDV(codeBlock);
+  if (foldBinary(OP_DV)) return;
+  if (reduceStrength(OP_DV)) return;
+  EMIT(emitDV(codeBlock));
 }
 
 void genNEG(void) {
-  emitNEG(codeBlock);
+  Instruction* prev = fusible(OPT_FOLD, 1);
+
+  if (prev != NULL && prev->op == OP_LC) {
+    prev->q = evaluate(OP_SB, 0, prev->q);
+    return;
+  }
+  EMIT(emitNEG(codeBlock));
+}
+
+// A local compared with a constant. This waits for the comparison, since
+// ADI, IXA, folding and strength reduction all want the LC on its own.
+void fuseLocalConstant(void) {
+  Instruction* prev = fusible(OPT_SUPER, 2);
+
+  if (prev == NULL || prev[0].op != OP_LV || prev[0].p != 0 || prev[1].op != OP_LC) return;
+  prev[0].op = OP_LVC;
+  prev[0].p = prev[0].q;
+  prev[0].q = prev[1].q;
+  dropCode(1);
 }
 
 void genCV(void) {
-  emitCV(codeBlock);
+  EMIT(emitCV(codeBlock));
 }
 
 void genEQ(void) {
-  emitEQ(codeBlock);
+  fuseLocalConstant();
+  EMIT(emitEQ(codeBlock));
 }
 
 void genNE(void) {
-  emitNE(codeBlock);
+  fuseLocalConstant();
+  EMIT(emitNE(codeBlock));
 }
 
 void genGT(void) {
-  emitGT(codeBlock);
+  fuseLocalConstant();
+  EMIT(emitGT(codeBlock));
 }
 
 void genGE(void) {
-  emitGE(codeBlock);
+  fuseLocalConstant();
+  EMIT(emitGE(codeBlock));
 }
 
 void genLT(void) {
-  emitLT(codeBlock);
+  fuseLocalConstant();
+  EMIT(emitLT(codeBlock));
 }
 
 void genLE(void) {
-  emitLE(codeBlock);
+  fuseLocalConstant();
+  EMIT(emitLE(codeBlock));
+}
+
+/******************************************************************/
+
+// Nothing emitted from here on merges with the code before
+void barrier(void) {
+  lastLabel = codeBlock->codeSize;
 }
 
-void updateJ(Instruction* jmp, CodeAddress label) {
-  jmp->q = label;
+// A frame slot for an element address. Slots are reused once no loop is
+// left, but not by loops inside one another.
+int allocateSlot(void) {
+  if (usedSlots == numOfSlots) {
+    numOfSlots ++;
+    symtab->currentScope->frameSize ++;
+    codeBlock->code[frameInst].q = symtab->currentScope->frameSize;
+  }
+  return firstSlot + usedSlots ++;
 }
 
-void updateFJ(Instruction* jmp, CodeAddress label) {
-  jmp->q = label;
+// The loop keeping its element address in the slot that inst loads
+ForLoop* slotOwner(Instruction* inst) {
+  int i, j;
+
+  if (inst->op != OP_LV || inst->p != 0) return NULL;
+  for (i = 0; i < numOfForLoops && i < MAX_FOR_LOOPS; i ++)
+    for (j = 0; j < forLoops[i].numOfVariables; j ++)
+      if (forLoops[i].variables[j].slot == inst->q) return forLoops + i;
+  return NULL;
+}
+
+// The element address that inst loads, or loads through with LVI
+InductionVariable* slotVariable(ForLoop* loop, Instruction* inst) {
+  int i;
+
+  if ((inst->op != OP_LV && inst->op != OP_LVI) || inst->p != 0) return NULL;
+  for (i = 0; i < loop->numOfVariables; i ++)
+    if (loop->variables[i].slot == inst->q) return loop->variables + i;
+  return NULL;
+}
+
+// The innermost loop whose control variable inst loads
+ForLoop* controllingLoop(Instruction* inst) {
+  int i;
+
+  for (i = numOfForLoops - 1; i >= 0; i --)
+    if (i < MAX_FOR_LOOPS && forLoops[i].controlVar != NULL && forLoops[i].load.op == inst->op &&
+	forLoops[i].load.p == inst->p && forLoops[i].load.q == inst->q)
+      return forLoops + i;
+  return NULL;
+}
+
+InductionVariable* inductionVariable(ForLoop* loop, Instruction base, WORD offset, int size) {
+  InductionVariable* v;
+  int i;
+
+  for (i = 0; i < loop->numOfVariables; i ++) {
+    v = loop->variables + i;
+    if (v->base.op == base.op && v->base.p == base.p && v->base.q == base.q &&
+	v->offset == offset && v->size == size)
+      return v;
+  }
+  if (loop->numOfVariables == MAX_INDUCTION_VARIABLES) return NULL;
+  v = loop->variables + loop->numOfVariables ++;
+  v->base = base;
+  v->offset = offset;
+  v->size = size;
+  v->slot = allocateSlot();
+  return v;
+}
+
+// Adds the index on top, times size, to the address below it: IXA size
+// under OPT_SUPER, unless folding or strength reduction leave nothing to
+// multiply
+void genIndex(int size) {
+  Instruction* prev;
+
+  genLC(size);
+  genML();
+  prev = fusible(OPT_SUPER, 2);
+  if (prev != NULL && prev[0].op == OP_LC && prev[0].q == size && prev[1].op == OP_ML) {
+    prev[0].op = OP_IXA;
+    dropCode(1);
+    return;
+  }
+  prev = fusible(OPT_SUPER, 1);
+  if (prev != NULL && prev->op == OP_SHL && size > 1 && size == (1 << prev->q)) {
+    prev->op = OP_IXA;
+    prev->q = size;
+    return;
+  }
+  genAD();
+}
+
+// base + (control variable + offset) * size, from scratch. The base is
+// an instruction of its own, so that the loop owning it can find it.
+void genElementAddress(ForLoop* loop, InductionVariable* v) {
+  barrier();
+  EMIT(emitCode(codeBlock, v->base.op, v->base.p, v->base.q));
+  barrier();
+  EMIT(emitCode(codeBlock, loop->load.op, loop->load.p, loop->load.q));
+  if (v->offset != 0) {
+    genLC(v->offset);
+    genAD();
+  }
+  genIndex(v->size);
+}
+
+/* A subscript that is the control variable of a loop, plus or minus a
+ * constant, on an array address that stays the same all through that
+ * loop: the address of an array variable or an element address of an
+ * outer loop. The whole element address then comes from a slot. */
+int inductionSubscript(CodeAddress subscript, int size) {
+  Instruction* code = codeBlock->code;
+  Instruction* index = code + subscript;
+  ForLoop* loop;
+  ForLoop* owner;
+  InductionVariable* v;
+  WORD offset = 0;
+  int n = codeBlock->codeSize - subscript;
+
+  if (!(optimizations & OPT_INDUCTION) || subscript < 1 || lastLabel > subscript) return FALSE;
+  switch (n) {
+  case 1:
+    break;
+  case 2:
+    if (index[1].op != OP_ADI) return FALSE;
+    offset = index[1].q;
+    break;
+  case 3:
+    if (index[1].op != OP_LC || (index[2].op != OP_AD && index[2].op != OP_SB)) return FALSE;
+    offset = (index[2].op == OP_AD) ? index[1].q : evaluate(OP_SB, 0, index[1].q);
+    break;
+  default:
+    return FALSE;
+  }
+
+  loop = controllingLoop(index);
+  if (loop == NULL) return FALSE;
+  if (code[subscript - 1].op != OP_LA) {
+    owner = slotOwner(code + subscript - 1);
+    if (owner == NULL || owner >= loop) return FALSE;
+  }
+
+  v = inductionVariable(loop, code[subscript - 1], offset, size);
+  if (v == NULL) return FALSE;
+  dropCode(n + 1);
+  barrier();
+  EMIT(emitLV(codeBlock, 0, v->slot));
+  barrier();
+  return TRUE;
+}
+
+void genSubscript(CodeAddress subscript, int size) {
+  if (inductionSubscript(subscript, size)) return;
+  genIndex(size);
+}
+
+void beginForLoop(Object* controlVar, Object* limitVar) {
+  ForLoop* loop;
+
+  if (numOfForLoops ++ >= MAX_FOR_LOOPS) return;
+  loop = forLoops + numOfForLoops - 1;
+  loop->controlVar = NULL;
+  loop->dirty = FALSE;
+  loop->limitVar = limitVar;
+  loop->limitDirty = (limitVar == controlVar);
+  loop->numOfVariables = 0;
+  if ((optimizations & OPT_INDUCTION) && controlVar->kind == OBJ_VARIABLE) {
+    loop->controlVar = controlVar;
+    loop->load.op = OP_LV;
+    loop->load.p = levelDifference(VARIABLE_SCOPE(controlVar));
+    loop->load.q = VARIABLE_OFFSET(controlVar);
+    if (loop->load.p > 0 && (optimizations & OPT_DISPLAY)) {
+      loop->load.op = OP_LVD;
+      loop->load.p = displayLevel(loop->load.p);
+    }
+  }
+}
+
+/* FORN body, if the limit on the stack still holds. Otherwise the limit
+ * goes, the control variable goes up, and FORI tests it against the
+ * limit evaluated again. */
+void genForNext(ForLoop* loop, CodeAddress limit, CodeAddress fori, CodeAddress body) {
+  Instruction inst;
+  CodeAddress at, next;
+
+  if (fori == limit + 1 && codeBlock->code[limit].op == OP_LC) {
+    genFORN(body);
+    return;
+  }
+  if (loop != NULL && loop->limitVar != NULL && !loop->limitDirty) {
+    genFORN(body);
+    return;
+  }
+
+  genDCT(1);
+  genCV();
+  genCV();
+  genLI();
+  genLC(1);
+  genAD();
+  genST();
+  barrier();
+  for (at = limit; at < fori; at ++) {
+    inst = codeBlock->code[at];
+    EMIT(emitCode(codeBlock, inst.op, inst.p, inst.q));
+  }
+  next = genFORI(DC_VALUE);
+  genJ(body);
+  updateFJ(next, getCurrentCodeAddress());
+}
+
+/* Without element addresses this is FORI exit; body; FORN body. With
+ * them, FORI becomes a jump to code after the loop that sets up the
+ * slots, tests the limit and jumps back; each iteration ends with INCL
+ * on the slots. If the body may change the control variable after all,
+ * the slots are left out, and each load of one jumps to code that
+ * computes the element address from scratch and jumps back. */
+void endForLoop(CodeAddress limit, CodeAddress fori, CodeAddress body) {
+  ForLoop* loop;
+  InductionVariable* v;
+  CodeAddress exit, at, stub;
+  int i;
+
+  numOfForLoops --;
+  if (numOfForLoops == 0) usedSlots = 0;
+  loop = (numOfForLoops < MAX_FOR_LOOPS) ? forLoops + numOfForLoops : NULL;
+  if (loop == NULL || loop->numOfVariables == 0) {
+    genForNext(loop, limit, fori, body);
+    updateFJ(fori, getCurrentCodeAddress());
+    return;
+  }
+
+  if (!loop->dirty)
+    for (i = 0; i < loop->numOfVariables; i ++)
+      EMIT(emitINCL(codeBlock, loop->variables[i].slot, loop->variables[i].size));
+  genForNext(loop, limit, fori, body);
+  exit = genJ(DC_VALUE);
+
+  if (loop->dirty) {
+    for (at = body; at < exit; at ++) {
+      v = slotVariable(loop, codeBlock->code + at);
+      if (v == NULL) continue;
+      stub = codeBlock->codeSize;
+      genElementAddress(loop, v);
+      if (codeBlock->code[at].op == OP_LVI) genLI();
+      genJ(at + 1);
+      codeBlock->code[at].op = OP_J;
+      codeBlock->code[at].p = DC_VALUE;
+      codeBlock->code[at].q = stub;
+    }
+    updateFJ(fori, codeBlock->codeSize);
+  } else {
+    codeBlock->code[fori].op = OP_J;
+    updateJ(fori, codeBlock->codeSize);
+    for (i = 0; i < loop->numOfVariables; i ++) {
+      genElementAddress(loop, loop->variables + i);
+      EMIT(emitSTV(codeBlock, 0, loop->variables[i].slot));
+    }
+    fori = genFORI(DC_VALUE);
+    genJ(body);
+    updateFJ(fori, codeBlock->codeSize);
+  }
+  updateJ(exit, getCurrentCodeAddress());
+}
+
+/******************************************************************/
+
+// The number of the procedure with that scope in this pass, or -1
+int procedureOf(Scope* scope) {
+  int i;
+
+  for (i = 0; i < numOfProcedures; i ++)
+    if (liftedProcedures[i].scope == scope) return i;
+  return -1;
+}
+
+int findFreeSlot(LiftedProcedure* procedure, int owner, int offset) {
+  int i;
+
+  for (i = 0; i < procedure->numOfSlots; i ++)
+    if (procedure->slots[i].owner == owner && procedure->slots[i].offset == offset) return i;
+  return -1;
+}
+
+// Adds the slot, or marks it by reference; FALSE if memory runs out
+int addFreeSlot(LiftedProcedure* procedure, int owner, int offset, int byReference) {
+  FreeSlot* slots;
+  int i = findFreeSlot(procedure, owner, offset);
+
+  if (i < 0) {
+    slots = (FreeSlot*) realloc(procedure->slots, (procedure->numOfSlots + 1) * sizeof(FreeSlot));
+    if (slots == NULL) return FALSE;
+    procedure->slots = slots;
+    i = procedure->numOfSlots ++;
+    slots[i].owner = owner;
+    slots[i].offset = offset;
+    slots[i].byReference = FALSE;
+  }
+  if (byReference) procedure->slots[i].byReference = TRUE;
+  return TRUE;
+}
+
+/* Slots are recorded by their offsets in the first pass. The extra
+ * parameters move the locals of the second pass up past them. */
+int firstPassOffset(LiftedProcedure* procedure, int offset) {
+  return (offset >= procedure->firstParam + procedure->numOfSlots) ? offset - procedure->numOfSlots : offset;
+}
+
+int secondPassOffset(LiftedProcedure* procedure, int offset) {
+  return (offset >= procedure->firstParam) ? offset + procedure->numOfSlots : offset;
+}
+
+void declareFreeParams(void) {
+  LiftedProcedure* procedure;
+
+  if (!(optimizations & OPT_LIFT)) return;
+  if (liftingPass) {
+    // Both passes declare the same procedures in the same order
+    procedure = liftedProcedures + numOfProcedures ++;
+    procedure->scope = symtab->currentScope;
+    procedure->firstParam = symtab->currentScope->frameSize;
+    symtab->currentScope->frameSize += procedure->numOfSlots;
+    return;
+  }
+
+  if (numOfProcedures == maxLiftedProcedures) {
+    maxLiftedProcedures = 2 * maxLiftedProcedures + 16;
+    procedure = (LiftedProcedure*) realloc(liftedProcedures, maxLiftedProcedures * sizeof(LiftedProcedure));
+    if (procedure == NULL) error(ERR_CODE_TOO_LARGE, currentToken->lineNo, currentToken->colNo);
+    liftedProcedures = procedure;
+  }
+  procedure = liftedProcedures + numOfProcedures ++;
+  numOfLiftedProcedures = numOfProcedures;
+  procedure->scope = symtab->currentScope;
+  procedure->firstParam = symtab->currentScope->frameSize;
+  procedure->slots = NULL;
+  procedure->numOfSlots = 0;
+  procedure->callees = NULL;
+  procedure->numOfCallees = 0;
+}
+
+/* LA or LV of a slot level frames out. The first pass records it, the
+ * second emits the direct address of a variable of the program or the
+ * extra parameter for the slot. TRUE if the code is emitted. */
+int liftedAccess(int level, int offset, int address) {
+  Scope* scope = symtab->currentScope;
+  LiftedProcedure* procedure;
+  int current, owner, i;
+
+  if (!(optimizations & OPT_LIFT)) return FALSE;
+  for (i = 0; i < level && scope->outer != NULL; i ++) scope = scope->outer;
+
+  if (scope->outer == NULL) {
+    if (!liftingPass) return FALSE;
+    EMIT(address ? emitLAD(codeBlock, 0, offset) : emitLVD(codeBlock, 0, offset));
+    return TRUE;
+  }
+
+  current = procedureOf(symtab->currentScope);
+  owner = procedureOf(scope);
+  if (current < 0 || owner < 0) return FALSE;
+  procedure = liftedProcedures + current;
+  if (!liftingPass) {
+    if (!addFreeSlot(procedure, owner, offset, address))
+      error(ERR_CODE_TOO_LARGE, currentToken->lineNo, currentToken->colNo);
+    return FALSE;
+  }
+
+  i = findFreeSlot(procedure, owner, firstPassOffset(liftedProcedures + owner, offset));
+  if (i < 0) return FALSE;
+  genLV(0, procedure->firstParam + i);
+  if (procedure->slots[i].byReference && !address) genLI();
+  return TRUE;
+}
+
+// The extra parameters of the procedure with that scope
+int numOfFreeParams(Scope* scope) {
+  int i;
+
+  if (!(optimizations & OPT_LIFT) || !liftingPass || (i = procedureOf(scope)) < 0) return 0;
+  return liftedProcedures[i].numOfSlots;
+}
+
+int genFreeArguments(Object* callee) {
+  Scope* scope = (callee->kind == OBJ_FUNCTION) ? callee->funcAttrs->scope : callee->procAttrs->scope;
+  LiftedProcedure* procedure;
+  LiftedProcedure* owner;
+  FreeSlot* slot;
+  int i, offset;
+
+  if (!(optimizations & OPT_LIFT) || !liftingPass || (i = procedureOf(scope)) < 0) return 0;
+  procedure = liftedProcedures + i;
+  for (i = 0; i < procedure->numOfSlots; i ++) {
+    slot = procedure->slots + i;
+    owner = liftedProcedures + slot->owner;
+    offset = secondPassOffset(owner, slot->offset);
+    if (slot->byReference) genLA(levelDifference(owner->scope), offset);
+    else genLV(levelDifference(owner->scope), offset);
+  }
+  return procedure->numOfSlots;
+}
+
+void recordCall(Object* callee) {
+  Scope* scope = (callee->kind == OBJ_FUNCTION) ? callee->funcAttrs->scope : callee->procAttrs->scope;
+  LiftedProcedure* procedure;
+  int* callees;
+  int current = procedureOf(symtab->currentScope);
+  int called = procedureOf(scope);
+
+  if (current < 0 || called < 0) return;
+  procedure = liftedProcedures + current;
+  callees = (int*) realloc(procedure->callees, (procedure->numOfCallees + 1) * sizeof(int));
+  if (callees == NULL) error(ERR_CODE_TOO_LARGE, currentToken->lineNo, currentToken->colNo);
+  procedure->callees = callees;
+  callees[procedure->numOfCallees ++] = called;
+}
+
+int liftProcedures(void) {
+  LiftedProcedure* procedure;
+  FreeSlot* slot;
+  int changed, i, j, k, n;
+
+  // A caller passes on what its callees need, unless the slot is its own
+  do {
+    changed = FALSE;
+    for (i = 0; i < numOfLiftedProcedures; i ++) {
+      procedure = liftedProcedures + i;
+      for (j = 0; j < procedure->numOfCallees; j ++) {
+	LiftedProcedure* callee = liftedProcedures + procedure->callees[j];
+	for (k = 0; k < callee->numOfSlots; k ++) {
+	  slot = callee->slots + k;
+	  if (slot->owner == i) continue;
+	  n = procedure->numOfSlots;
+	  if (findFreeSlot(procedure, slot->owner, slot->offset) < 0 &&
+	      !addFreeSlot(procedure, slot->owner, slot->offset, FALSE))
+	    return FALSE;
+	  if (procedure->numOfSlots != n) changed = TRUE;
+	}
+      }
+    }
+  } while (changed);
+
+  // A slot goes by reference everywhere if any inner procedure takes its address
+  for (i = 0; i < numOfLiftedProcedures; i ++)
+    for (j = 0; j < liftedProcedures[i].numOfSlots; j ++) {
+      slot = liftedProcedures[i].slots + j;
+      if (!slot->byReference) continue;
+      for (k = 0; k < numOfLiftedProcedures; k ++)
+	if ((n = findFreeSlot(liftedProcedures + k, slot->owner, slot->offset)) >= 0)
+	  liftedProcedures[k].slots[n].byReference = TRUE;
+    }
+
+  liftingPass = TRUE;
+  return TRUE;
+}
+
+/* The control variable of the loop may change in its body. Loops open
+ * inside it may take their element addresses from its slots, which then
+ * no longer hold, so they may not keep theirs either. */
+void markDirty(int loop) {
+  int i;
+
+  for (i = loop; i < numOfForLoops && i < MAX_FOR_LOOPS; i ++)
+    forLoops[i].dirty = TRUE;
+}
+
+void noteAssignment(Object* var) {
+  int i;
+
+  for (i = 0; i < numOfForLoops && i < MAX_FOR_LOOPS; i ++) {
+    if (forLoops[i].controlVar == var) markDirty(i);
+    if (forLoops[i].limitVar == var) forLoops[i].limitDirty = TRUE;
+  }
+}
+
+// Whether a procedure in scope can see var
+int visibleIn(Scope* scope, Object* var) {
+  Scope* home = (var->kind == OBJ_VARIABLE) ? VARIABLE_SCOPE(var) : PARAMETER_SCOPE(var);
+
+  for (; scope != NULL; scope = scope->outer)
+    if (scope == home) return TRUE;
+  return FALSE;
+}
+
+// The callee may change the control variables and limits it can see
+void noteCall(Object* callee) {
+  Scope* scope = (callee->kind == OBJ_FUNCTION) ? callee->funcAttrs->scope : callee->procAttrs->scope;
+  int i;
+
+  if ((optimizations & OPT_LIFT) && !liftingPass) recordCall(callee);
+
+  for (i = 0; i < numOfForLoops && i < MAX_FOR_LOOPS; i ++) {
+    if (forLoops[i].controlVar != NULL && visibleIn(scope->outer, forLoops[i].controlVar))
+      markDirty(i);
+    if (forLoops[i].limitVar != NULL && visibleIn(scope->outer, forLoops[i].limitVar))
+      forLoops[i].limitDirty = TRUE;
+  }
+}
+
+void updateJ(CodeAddress jmp, CodeAddress label) {
+  codeBlock->code[jmp].q = label;
+}
+
+void updateFJ(CodeAddress jmp, CodeAddress label) {
+  codeBlock->code[jmp].q = label;
+}
+
+CodeFragment* cutCode(CodeAddress from) {
+  CodeFragment* fragment = (CodeFragment*) malloc(sizeof(CodeFragment));
+  int n = NUM_OF_LINES(codeBlock);
+  int i;
+
+  if (fragment == NULL) 
+    error(ERR_CODE_TOO_LARGE, currentToken->lineNo, currentToken->colNo);
+
+  // Line entries are in address order, those of the fragment come last.
+  // The fragment starts with the line in effect at from.
+  while (n > 0 && LINE_ENTRY(codeBlock, n - 1)->codeAddress >= from) n --;
+  fragment->codeSize = codeBlock->codeSize - from;
+  fragment->numOfLines = 0;
+  fragment->code = (Instruction*) malloc(fragment->codeSize * sizeof(Instruction) + 1);
+  fragment->lines = (LineEntry*) malloc((NUM_OF_LINES(codeBlock) - n + 1) * sizeof(LineEntry));
+  if (fragment->code == NULL || fragment->lines == NULL)
+    error(ERR_CODE_TOO_LARGE, currentToken->lineNo, currentToken->colNo);
+
+  memcpy(fragment->code, codeBlock->code + from, fragment->codeSize * sizeof(Instruction));
+  if (n > 0 && (n == NUM_OF_LINES(codeBlock) || LINE_ENTRY(codeBlock, n)->codeAddress > from)) {
+    fragment->lines[0].codeAddress = 0;
+    fragment->lines[0].lineNo = LINE_ENTRY(codeBlock, n - 1)->lineNo;
+    fragment->numOfLines = 1;
+  }
+  for (i = n; i < NUM_OF_LINES(codeBlock); i ++) {
+    fragment->lines[fragment->numOfLines] = *LINE_ENTRY(codeBlock, i);
+    fragment->lines[fragment->numOfLines].codeAddress -= from;
+    fragment->numOfLines ++;
+  }
+
+  codeBlock->codeSize = from;
+  codeBlock->lines.size = n * sizeof(LineEntry);
+  if (lastLabel > from) lastLabel = from;
+  return fragment;
+}
+
+void pasteCode(CodeFragment* fragment) {
+  CodeAddress from = codeBlock->codeSize;
+  int i;
+
+  for (i = 0; i < fragment->codeSize; i ++) {
+    Instruction* inst = fragment->code + i;
+    if (!emitCode(codeBlock, inst->op, inst->p, inst->q))
+      error(ERR_CODE_TOO_LARGE, currentToken->lineNo, currentToken->colNo);
+  }
+  for (i = 0; i < fragment->numOfLines; i ++)
+    if (!addLineEntry(codeBlock, from + fragment->lines[i].codeAddress, fragment->lines[i].lineNo))
+      error(ERR_CODE_TOO_LARGE, currentToken->lineNo, currentToken->colNo);
+
+  free(fragment->code);
+  free(fragment->lines);
+  free(fragment);
+}
+
+void recordConstant(Object* constObj) {
+  ConstantValue* value = constObj->constAttrs->value;
+
+  if (outputFormat == FORMAT_BARE) return;
+  if (!addConstantEntry(codeBlock, constObj->name, 
+			(value->type == TP_INT) ? value->intValue : value->charValue))
+    error(ERR_CODE_TOO_LARGE, currentToken->lineNo, currentToken->colNo);
+}
+
+// Records a procedure, function or the program once its frame is known.
+// A lifted procedure runs at level 1 and takes its extra parameters too.
+void recordProcedure(Object* obj) {
+  Scope* scope = symtab->currentScope;
+  int level = scopeLevel(scope), ok;
+
+  if (outputFormat == FORMAT_BARE) return;
+  if (level > 0 && (optimizations & OPT_LIFT)) level = 1;
+
+  switch (obj->kind) {
+  case OBJ_FUNCTION:
+    ok = addProcedureEntry(codeBlock, obj->name, obj->funcAttrs->codeAddress, level,
+			   obj->funcAttrs->paramCount + numOfFreeParams(scope), FUNCTION_FRAME_SIZE(obj));
+    break;
+  case OBJ_PROCEDURE:
+    ok = addProcedureEntry(codeBlock, obj->name, obj->procAttrs->codeAddress, level,
+			   obj->procAttrs->paramCount + numOfFreeParams(scope), PROCEDURE_FRAME_SIZE(obj));
+    break;
+  default:
+    ok = addProcedureEntry(codeBlock, obj->name, obj->progAttrs->codeAddress, level,
+			   0, PROGRAM_FRAME_SIZE(obj));
+    break;
+  }
+  if (!ok) error(ERR_CODE_TOO_LARGE, currentToken->lineNo, currentToken->colNo);
 }
 
 CodeAddress getCurrentCodeAddress(void) {
+  lastLabel = codeBlock->codeSize;
   return codeBlock->codeSize;
 }
 
 
 void initCodeBuffer(void) {
-  codeBlock = createCodeBlock(CODE_SIZE);
+  codeBlock = createCodeBlock(INITIAL_CODE_SIZE);
+  lastLabel = 0;
+  numOfForLoops = 0;
+  numOfProcedures = 0;
+  memset(displayUsed, 0, sizeof(displayUsed));
 }
 
 void printCodeBuffer(void) {
@@ -215,12 +1257,22 @@ void cleanCodeBuffer(void) {
   freeCodeBlock(codeBlock);
 }
 
+int optimizeCodeBuffer(void) {
+  return peephole(codeBlock);
+}
+
 int serialize(char* fileName) {
   FILE* f;
 
+  int ok;
+
   f = fopen(fileName, "wb");
   if (f == NULL) return IO_ERROR;
-  saveCode(codeBlock, f);
-  fclose(f);
-  return IO_SUCCESS;
+  if (outputFormat == FORMAT_SECTIONED)
+    ok = saveCodeFile(codeBlock, f, 0);
+  else if (outputFormat == FORMAT_COMPACT)
+    ok = saveCodeFile(codeBlock, f, SECTION_COMPACT);
+  else ok = saveCode(codeBlock, f);
+  if (fclose(f) != 0) ok = 0;
+  return ok ? IO_SUCCESS : IO_ERROR;
 }
\ No newline at end of file
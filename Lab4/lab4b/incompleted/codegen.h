@@ -29,25 +29,131 @@
 #define PARAMETER_OFFSET(param) (param->paramAttrs->localOffset)
 #define PARAMETER_SCOPE(param) (param->paramAttrs->scope)
 
+// Output formats, see serialize
+#define FORMAT_BARE 0       // a bare Instruction[], as read by the reference interpreter
+#define FORMAT_SECTIONED 1  // the sectioned format of instructions.h
+#define FORMAT_COMPACT 2    // the sectioned format with compact code
+
+extern int outputFormat;
+extern int genLineInfo;
+
+// Optimizations, enabled one by one with kplc -f<name> or all with -O
+#define OPT_SUPER 0x01      // superinstructions, see instructions.h
+#define OPT_BRANCH 0x02     // compare and branch instead of compare; FJ
+#define OPT_ROTATE 0x04     // loops test their condition at the bottom
+#define OPT_FOR 0x08        // FOR loops with FORI and FORN
+#define OPT_FOLD 0x10       // constant folding and algebraic identities
+#define OPT_PEEPHOLE 0x20   // the peephole pass of peephole.h over the whole code
+#define OPT_STRENGTH 0x40   // shifts and multiplications for * and / by constants
+#define OPT_INDUCTION 0x80  // running element addresses in FOR loops, see ForLoop
+#define OPT_DISPLAY 0x100   // non-local variables through a display, see genFrame
+#define OPT_LIFT 0x200      // lambda lifting of nested procedures, see LiftedProcedure
+
+extern int optimizations;
+
+// Code cut out of the buffer, to be pasted back further down
+struct CodeFragment_ {
+  Instruction* code;
+  int codeSize;
+  LineEntry* lines;   // addresses relative to the fragment
+  int numOfLines;
+};
+
+typedef struct CodeFragment_ CodeFragment;
+
+#define MAX_FOR_LOOPS 16
+#define MAX_INDUCTION_VARIABLES 8
+
+/* An element address that a FOR loop keeps in a frame slot of its own,
+ * for a subscript that is the control variable plus a constant. The
+ * slot is set up once before the loop and goes up by the element size
+ * with every iteration, so the body only loads it. */
+struct InductionVariable_ {
+  Instruction base;   // LA of the array, or LV of the slot of an outer loop
+  WORD offset;        // added to the control variable
+  int size;           // the element size
+  int slot;
+};
+
+typedef struct InductionVariable_ InductionVariable;
+
+struct ForLoop_ {
+  Object* controlVar; // NULL if the loop keeps no element addresses
+  Instruction load;   // LV of the control variable
+  int dirty;          // the body may change the control variable
+  Object* limitVar;   // the limit, if it is a variable or value parameter
+  int limitDirty;     // the body may change limitVar
+  int numOfVariables;
+  InductionVariable variables[MAX_INDUCTION_VARIABLES];
+};
+
+typedef struct ForLoop_ ForLoop;
+
+/* Lambda lifting compiles the program twice. The first pass records,
+ * for each procedure in declaration order, the slots of outer frames
+ * it reaches and the procedures it calls; liftProcedures then adds the
+ * slots its callees need. In the second pass those slots are extra
+ * parameters after the declared ones: a value parameter if no inner
+ * procedure takes the slot's address, otherwise a VAR parameter. Calls
+ * pass them along, and variables of the program are addressed directly
+ * as LAD 0,q and LVD 0,q, so no procedure needs a static link. */
+struct FreeSlot_ {
+  int owner;          // the procedure whose frame holds the slot
+  int offset;
+  int byReference;    // some inner procedure uses its address
+};
+
+typedef struct FreeSlot_ FreeSlot;
+
+struct LiftedProcedure_ {
+  Scope* scope;       // in the current pass
+  int firstParam;     // the offset of the first extra parameter
+  FreeSlot* slots;
+  int numOfSlots;
+  int* callees;
+  int numOfCallees;
+};
+
+typedef struct LiftedProcedure_ LiftedProcedure;
+
 #define RETURN_VALUE_OFFSET 0
 #define DYNAMIC_LINK_OFFSET 1
 #define RETURN_ADDRESS_OFFSET 2
 #define STATIC_LINK_OFFSET 3
 
+// The machine's arithmetic, for constant folding and constant expressions
+WORD evaluate(enum OpCode op, WORD x, WORD y);
+
+// Static links from the current scope out to scope
+int levelDifference(Scope* scope);
+
 void genVariableAddress(Object* var);
 void genVariableValue(Object* var);
 
 void genPredefinedProcedureCall(Object* proc);
 void genPredefinedFunctionCall(Object* func);
 
+/* INT for the frame of the current scope, which FOR loops may still grow.
+ * With OPT_DISPLAY, LA and LV of outer frames become LAD and LVD on the
+ * lexical level of the frame. A procedure whose inner procedures do that
+ * enters its frame into the display here with DSP, and genEP or genEF
+ * take it out again with DRS. Nothing follows static links any more, so
+ * CALL passes none. */
+void genFrame(void);
+
 void genLA(int level, int offset);
 void genLV(int level, int offset);
 void genLC(WORD constant);
 void genLI(void);
 void genINT(int delta);
 void genDCT(int delta);
-Instruction* genJ(CodeAddress label);
-Instruction* genFJ(CodeAddress label);
+CodeAddress genJ(CodeAddress label);
+CodeAddress genFJ(CodeAddress label);
+// Jumps to label if the condition just compiled holds
+void genTJ(CodeAddress label);
+// FOR loop control, patched with updateFJ like FJ
+CodeAddress genFORI(CodeAddress label);
+void genFORN(CodeAddress label);
 void genHL(void);
 void genST(void);
 void genCALL(int level, CodeAddress label);
@@ -71,16 +177,59 @@ void genGE(void);
 void genLT(void);
 void genLE(void);
 
-void updateJ(Instruction* jmp, CodeAddress label);
-void updateFJ(Instruction* jmp, CodeAddress label);
-
+// Stores the expression compiled at expression into the lvalue compiled
+// at lvalue; same as genST unless superinstructions apply
+void genAssign(CodeAddress lvalue, CodeAddress expression);
+
+// Adds the subscript compiled at subscript, times the element size, to
+// the array address before it
+void genSubscript(CodeAddress subscript, int size);
+
+/* A FOR loop with its limit at limit, FORI at fori and its body at body.
+ * beginForLoop comes right after FORI, with the limit's variable if the
+ * limit is nothing else; endForLoop emits FORN and patches FORI. FORN
+ * keeps the limit from the start, so unless the limit is a constant or
+ * a variable the body cannot change, endForLoop evaluates it again for
+ * each iteration, as the loop without FORI and FORN does. */
+void beginForLoop(Object* controlVar, Object* limitVar);
+void endForLoop(CodeAddress limit, CodeAddress fori, CodeAddress body);
+// Right after the parameters of a procedure or function: in the second
+// lifting pass, declares its extra parameters
+void declareFreeParams(void);
+// Pushes the extra arguments of a lifted callee; their number
+int genFreeArguments(Object* callee);
+// Ends the first lifting pass; FALSE if memory runs out
+int liftProcedures(void);
+
+// Statements in a loop body that may change a control variable. Calls
+// also make up the call graph for lambda lifting.
+void noteAssignment(Object* var);
+void noteCall(Object* callee);
+
+void updateJ(CodeAddress jmp, CodeAddress label);
+void updateFJ(CodeAddress jmp, CodeAddress label);
+
+// The address of the next instruction. Emission never merges code across
+// an address handed out here, since it may become a jump target.
 CodeAddress getCurrentCodeAddress(void);
+
+// Moves the straight-line code from the given address to the end of the
+// buffer into a fragment; pasteCode appends it again and frees it
+CodeFragment* cutCode(CodeAddress from);
+void pasteCode(CodeFragment* fragment);
+
 int isPredefinedProcedure(Object* proc);
 int isPredefinedFunction(Object* func);
 
+// Tables for the sectioned output format
+void recordConstant(Object* constObj);
+void recordProcedure(Object* obj);
+
 void initCodeBuffer(void);
 void printCodeBuffer(void);
 void cleanCodeBuffer(void);
+// Runs the peephole pass; the number of instructions removed, or -1
+int optimizeCodeBuffer(void);
 
 int serialize(char* fileName);
 
@@ -37,7 +37,10 @@ typedef enum {
   ERR_UNDECLARED_PROCEDURE,
   ERR_DUPLICATE_IDENT,
   ERR_TYPE_INCONSISTENCY,
-  ERR_PARAMETERS_ARGUMENTS_INCONSISTENCY
+  ERR_PARAMETERS_ARGUMENTS_INCONSISTENCY,
+  ERR_CODE_TOO_LARGE,
+  ERR_DIVISION_BY_ZERO,
+  ERR_INVALID_ARRAY_SIZE
 } ErrorCode;
 
 void error(ErrorCode err, int lineNo, int colNo);
@@ -5,29 +5,187 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
 #include "instructions.h"
 
-#define MAX_BLOCK 50
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
 
-CodeBlock* createCodeBlock(int maxSize) {
+#define READ_CHUNK_SIZE (1 << 16)
+#define MAX_SECTIONS 16
+
+void initSection(Section* section) {
+  section->data = NULL;
+  section->size = 0;
+  section->maxSize = 0;
+}
+
+CodeBlock* createCodeBlock(int initialSize) {
   CodeBlock* codeBlock = (CodeBlock*) malloc(sizeof(CodeBlock));
 
-  codeBlock->code = (Instruction*) malloc(maxSize * sizeof(Instruction));
+  if (initialSize < 1) initialSize = 1;
+  codeBlock->code = (Instruction*) malloc(initialSize * sizeof(Instruction));
   codeBlock->codeSize = 0;
-  codeBlock->maxSize = maxSize;
+  codeBlock->maxSize = initialSize;
+  codeBlock->entry = 0;
+  initSection(&codeBlock->compact);
+  initSection(&codeBlock->constants);
+  initSection(&codeBlock->procedures);
+  initSection(&codeBlock->lines);
+  initSection(&codeBlock->strings);
+  codeBlock->image = NULL;
+  codeBlock->imageSize = 0;
+  codeBlock->mapped = 0;
   return codeBlock;
 }
 
+// Doubles the capacity, so emission stays amortized O(1)
+int growCodeBlock(CodeBlock* codeBlock) {
+  Instruction* code;
+  int maxSize;
+
+  if (codeBlock->image != NULL) return 0;
+  if (codeBlock->maxSize > INT_MAX / 2 / (int) sizeof(Instruction)) return 0;
+  maxSize = codeBlock->maxSize * 2;
+  code = (Instruction*) realloc(codeBlock->code, maxSize * sizeof(Instruction));
+  if (code == NULL) return 0;
+  codeBlock->code = code;
+  codeBlock->maxSize = maxSize;
+  return 1;
+}
+
+// Drops the code and the tables, whether built here or loaded
+void releaseCode(CodeBlock* codeBlock) {
+  if (codeBlock->image == NULL) {
+    free(codeBlock->code);
+    free(codeBlock->constants.data);
+    free(codeBlock->procedures.data);
+    free(codeBlock->lines.data);
+    free(codeBlock->strings.data);
+    free(codeBlock->compact.data);
+  } 
+  else if (codeBlock->compact.data != NULL)
+    // Compact code is decoded into the heap
+    free(codeBlock->code);
+
+  if (codeBlock->image != NULL) {
+#ifndef _WIN32
+    if (codeBlock->mapped)
+      munmap(codeBlock->image, codeBlock->imageSize);
+    else
+#endif
+      free(codeBlock->image);
+  }
+
+  codeBlock->code = NULL;
+  codeBlock->codeSize = 0;
+  codeBlock->maxSize = 0;
+  codeBlock->entry = 0;
+  initSection(&codeBlock->compact);
+  initSection(&codeBlock->constants);
+  initSection(&codeBlock->procedures);
+  initSection(&codeBlock->lines);
+  initSection(&codeBlock->strings);
+  codeBlock->image = NULL;
+  codeBlock->imageSize = 0;
+  codeBlock->mapped = 0;
+}
+
 void freeCodeBlock(CodeBlock* codeBlock) {
-  free(codeBlock->code);
+  releaseCode(codeBlock);
   free(codeBlock);
 }
 
+// Appends size bytes to a table built by the compiler; returns the offset
+int appendSection(Section* section, void* data, int size) {
+  int offset = section->size;
+
+  if (section->maxSize == 0 && section->data != NULL) return -1;
+  if (section->size + size > section->maxSize) {
+    int maxSize = (section->maxSize == 0) ? 256 : section->maxSize;
+    char* buffer;
+
+    while (section->size + size > maxSize) {
+      if (maxSize > INT_MAX / 2) return -1;
+      maxSize *= 2;
+    }
+    buffer = (char*) realloc(section->data, maxSize);
+    if (buffer == NULL) return -1;
+    section->data = buffer;
+    section->maxSize = maxSize;
+  }
+  memcpy(section->data + section->size, data, size);
+  section->size += size;
+  return offset;
+}
+
+int addString(CodeBlock* codeBlock, char* string) {
+  return appendSection(&codeBlock->strings, string, strlen(string) + 1);
+}
+
+int addConstantEntry(CodeBlock* codeBlock, char* name, WORD value) {
+  ConstantEntry entry;
+
+  entry.name = addString(codeBlock, name);
+  if (entry.name < 0) return 0;
+  entry.value = value;
+  return appendSection(&codeBlock->constants, &entry, sizeof(entry)) >= 0;
+}
+
+int addProcedureEntry(CodeBlock* codeBlock, char* name, CodeAddress codeAddress, 
+		      int level, int numOfParams, int frameSize) {
+  ProcedureEntry entry;
+
+  entry.name = addString(codeBlock, name);
+  if (entry.name < 0) return 0;
+  entry.codeAddress = codeAddress;
+  entry.level = level;
+  entry.numOfParams = numOfParams;
+  entry.frameSize = frameSize;
+  return appendSection(&codeBlock->procedures, &entry, sizeof(entry)) >= 0;
+}
+
+// Lines are recorded as they change, so consecutive instructions of the
+// same line share one entry
+int addLineEntry(CodeBlock* codeBlock, CodeAddress codeAddress, int lineNo) {
+  LineEntry entry;
+  int n = NUM_OF_LINES(codeBlock);
+
+  if (n > 0) {
+    LineEntry* last = LINE_ENTRY(codeBlock, n - 1);
+    if (last->lineNo == lineNo) return 1;
+    if (last->codeAddress == codeAddress) {
+      last->lineNo = lineNo;
+      return 1;
+    }
+  }
+  entry.codeAddress = codeAddress;
+  entry.lineNo = lineNo;
+  return appendSection(&codeBlock->lines, &entry, sizeof(entry)) >= 0;
+}
+
+ProcedureEntry* findProcedureEntry(CodeBlock* codeBlock, char* name) {
+  int i;
+
+  for (i = 0; i < NUM_OF_PROCEDURES(codeBlock); i ++) {
+    ProcedureEntry* entry = PROCEDURE_ENTRY(codeBlock, i);
+    if (strcmp(SECTION_STRING(codeBlock, entry->name), name) == 0)
+      return entry;
+  }
+  return NULL;
+}
+
 int emitCode(CodeBlock* codeBlock, enum OpCode op, WORD p, WORD q) {
-  Instruction* bottom = codeBlock->code + codeBlock->codeSize;
+  Instruction* bottom;
 
-  if (codeBlock->codeSize >= codeBlock->maxSize) return 0;
+  if ((codeBlock->codeSize >= codeBlock->maxSize) && !growCodeBlock(codeBlock)) 
+    return 0;
 
+  bottom = codeBlock->code + codeBlock->codeSize;
   bottom->op = op;
   bottom->p = p;
   bottom->q = q;
@@ -66,6 +224,31 @@ int emitLT(CodeBlock* codeBlock) { return emitCode(codeBlock, OP_LT, DC_VALUE, D
 int emitGE(CodeBlock* codeBlock) { return emitCode(codeBlock, OP_GE, DC_VALUE, DC_VALUE); }
 int emitLE(CodeBlock* codeBlock) { return emitCode(codeBlock, OP_LE, DC_VALUE, DC_VALUE); }
 
+int emitADI(CodeBlock* codeBlock, WORD q) { return emitCode(codeBlock, OP_ADI, DC_VALUE, q); }
+int emitLV2(CodeBlock* codeBlock, WORD p, WORD q) { return emitCode(codeBlock, OP_LV2, p, q); }
+int emitLVI(CodeBlock* codeBlock, WORD p, WORD q) { return emitCode(codeBlock, OP_LVI, p, q); }
+int emitSTV(CodeBlock* codeBlock, WORD p, WORD q) { return emitCode(codeBlock, OP_STV, p, q); }
+int emitINC(CodeBlock* codeBlock, WORD q) { return emitCode(codeBlock, OP_INC, DC_VALUE, q); }
+int emitINCL(CodeBlock* codeBlock, WORD p, WORD q) { return emitCode(codeBlock, OP_INCL, p, q); }
+int emitJEQ(CodeBlock* codeBlock, WORD q) { return emitCode(codeBlock, OP_JEQ, DC_VALUE, q); }
+int emitJNE(CodeBlock* codeBlock, WORD q) { return emitCode(codeBlock, OP_JNE, DC_VALUE, q); }
+int emitJGT(CodeBlock* codeBlock, WORD q) { return emitCode(codeBlock, OP_JGT, DC_VALUE, q); }
+int emitJLT(CodeBlock* codeBlock, WORD q) { return emitCode(codeBlock, OP_JLT, DC_VALUE, q); }
+int emitJGE(CodeBlock* codeBlock, WORD q) { return emitCode(codeBlock, OP_JGE, DC_VALUE, q); }
+int emitJLE(CodeBlock* codeBlock, WORD q) { return emitCode(codeBlock, OP_JLE, DC_VALUE, q); }
+int emitFORI(CodeBlock* codeBlock, WORD q) { return emitCode(codeBlock, OP_FORI, DC_VALUE, q); }
+int emitFORN(CodeBlock* codeBlock, WORD q) { return emitCode(codeBlock, OP_FORN, DC_VALUE, q); }
+int emitSHL(CodeBlock* codeBlock, WORD q) { return emitCode(codeBlock, OP_SHL, DC_VALUE, q); }
+int emitSHR(CodeBlock* codeBlock, WORD q) { return emitCode(codeBlock, OP_SHR, DC_VALUE, q); }
+int emitDVM(CodeBlock* codeBlock, WORD p, WORD q) { return emitCode(codeBlock, OP_DVM, p, q); }
+int emitLAD(CodeBlock* codeBlock, WORD p, WORD q) { return emitCode(codeBlock, OP_LAD, p, q); }
+int emitLVD(CodeBlock* codeBlock, WORD p, WORD q) { return emitCode(codeBlock, OP_LVD, p, q); }
+int emitDSP(CodeBlock* codeBlock, WORD p) { return emitCode(codeBlock, OP_DSP, p, DC_VALUE); }
+int emitDRS(CodeBlock* codeBlock, WORD p) { return emitCode(codeBlock, OP_DRS, p, DC_VALUE); }
+int emitIXA(CodeBlock* codeBlock, WORD q) { return emitCode(codeBlock, OP_IXA, DC_VALUE, q); }
+int emitLIX(CodeBlock* codeBlock, WORD q) { return emitCode(codeBlock, OP_LIX, DC_VALUE, q); }
+int emitLVC(CodeBlock* codeBlock, WORD p, WORD q) { return emitCode(codeBlock, OP_LVC, p, q); }
+
 int emitBP(CodeBlock* codeBlock) { return emitCode(codeBlock, OP_BP, DC_VALUE, DC_VALUE); }
 
 
@@ -101,6 +284,30 @@ void printInstruction(Instruction* inst) {
   case OP_LT: printf("LT"); break;
   case OP_GE: printf("GE"); break;
   case OP_LE: printf("LE"); break;
+  case OP_ADI: printf("ADI %d", inst->q); break;
+  case OP_LV2: printf("LV2 %d,%d", inst->p, inst->q); break;
+  case OP_LVI: printf("LVI %d,%d", inst->p, inst->q); break;
+  case OP_STV: printf("STV %d,%d", inst->p, inst->q); break;
+  case OP_INC: printf("INC %d", inst->q); break;
+  case OP_INCL: printf("INCL %d,%d", inst->p, inst->q); break;
+  case OP_JEQ: printf("JEQ %d", inst->q); break;
+  case OP_JNE: printf("JNE %d", inst->q); break;
+  case OP_JGT: printf("JGT %d", inst->q); break;
+  case OP_JLT: printf("JLT %d", inst->q); break;
+  case OP_JGE: printf("JGE %d", inst->q); break;
+  case OP_JLE: printf("JLE %d", inst->q); break;
+  case OP_FORI: printf("FORI %d", inst->q); break;
+  case OP_FORN: printf("FORN %d", inst->q); break;
+  case OP_SHL: printf("SHL %d", inst->q); break;
+  case OP_SHR: printf("SHR %d", inst->q); break;
+  case OP_DVM: printf("DVM %d,%d", inst->p, inst->q); break;
+  case OP_LAD: printf("LAD %d,%d", inst->p, inst->q); break;
+  case OP_LVD: printf("LVD %d,%d", inst->p, inst->q); break;
+  case OP_DSP: printf("DSP %d", inst->p); break;
+  case OP_DRS: printf("DRS %d", inst->p); break;
+  case OP_IXA: printf("IXA %d", inst->q); break;
+  case OP_LIX: printf("LIX %d", inst->q); break;
+  case OP_LVC: printf("LVC %d,%d", inst->p, inst->q); break;
 
   case OP_BP: printf("BP"); break;
   default: break;
@@ -119,19 +326,425 @@ void printCodeBlock(CodeBlock* codeBlock) {
 }
 
 
-void loadCode(CodeBlock* codeBlock, FILE* f) {
-  Instruction* code = codeBlock->code;
-  int n;
+/******************************************************************/
 
-  codeBlock->codeSize = 0;
-  while (!feof(f)) {
-    n = fread(code, sizeof(Instruction), MAX_BLOCK, f);
-    code += n;
-    codeBlock->codeSize += n;
+int operandsOf(enum OpCode op) {
+  switch (op) {
+  case OP_LA: 
+  case OP_LV: 
+  case OP_LV2:
+  case OP_LVI:
+  case OP_STV:
+  case OP_INCL:
+  case OP_DVM:
+  case OP_LAD:
+  case OP_LVD:
+  case OP_LVC: return OPERAND_P | OPERAND_Q;
+  case OP_DSP:
+  case OP_DRS: return OPERAND_P;
+  case OP_CALL: return OPERAND_P | OPERAND_Q | OPERAND_TARGET;
+  case OP_J:
+  case OP_FJ:
+  case OP_JEQ:
+  case OP_JNE:
+  case OP_JGT:
+  case OP_JLT:
+  case OP_JGE:
+  case OP_JLE:
+  case OP_FORI:
+  case OP_FORN: return OPERAND_Q | OPERAND_TARGET;
+  case OP_LC:
+  case OP_INT:
+  case OP_DCT: 
+  case OP_ADI:
+  case OP_INC:
+  case OP_SHL:
+  case OP_SHR:
+  case OP_IXA:
+  case OP_LIX: return OPERAND_Q;
+  default: return 0;
+  }
+}
+
+#define ZIGZAG(v) ((((uint32_t) (v)) << 1) ^ (uint32_t) ((v) >> 31))
+#define UNZIGZAG(u) ((WORD) (((u) >> 1) ^ (0 - ((u) & 1))))
+
+int varintSize(WORD value) {
+  uint32_t u = ZIGZAG(value);
+  int n = 1;
+
+  while (u >= 0x80) {
+    u >>= 7;
+    n ++;
+  }
+  return n;
+}
+
+unsigned char* putVarint(unsigned char* out, WORD value) {
+  uint32_t u = ZIGZAG(value);
+
+  while (u >= 0x80) {
+    *out++ = (unsigned char) (u | 0x80);
+    u >>= 7;
+  }
+  *out++ = (unsigned char) u;
+  return out;
+}
+
+// Returns NULL on a truncated or overlong varint
+unsigned char* getVarint(unsigned char* in, unsigned char* limit, WORD* value) {
+  uint32_t u = 0;
+  int shift = 0;
+
+  while (in < limit) {
+    unsigned char byte = *in++;
+    u |= (uint32_t) (byte & 0x7F) << shift;
+    if ((byte & 0x80) == 0) {
+      *value = UNZIGZAG(u);
+      return in;
+    }
+    shift += 7;
+    if (shift > 28) return NULL;
   }
+  return NULL;
 }
 
+int encodedSize(Instruction* inst, int* offsets) {
+  int operands = operandsOf(inst->op);
+  int size = 1;
+
+  if (operands & OPERAND_P) size += varintSize(inst->p);
+  if (operands & OPERAND_TARGET) size += varintSize(offsets[inst->q]);
+  else if (operands & OPERAND_Q) size += varintSize(inst->q);
+  return size;
+}
+
+/* Encodes the code compactly. Targets are byte offsets, whose own sizes
+ * depend on the offsets, so the layout is iterated from the smallest
+ * encoding until it settles. Offsets, and so sizes, only grow between
+ * rounds, which bounds the number of rounds. */
+int encodeCode(CodeBlock* codeBlock, Section* compact) {
+  int n = codeBlock->codeSize;
+  int* offsets = (int*) calloc(n + 1, sizeof(int));
+  int* sizes = (int*) calloc(n + 1, sizeof(int));
+  int i, changed, ok = 0;
+  unsigned char* out;
+
+  if (offsets == NULL || sizes == NULL) goto done;
+  for (i = 0; i < n; i ++) {
+    Instruction* inst = codeBlock->code + i;
+    if ((operandsOf(inst->op) & OPERAND_TARGET) && (inst->q < 0 || inst->q > n)) 
+      goto done;
+  }
+
+  do {
+    changed = 0;
+    for (i = 0; i < n; i ++) {
+      int size = encodedSize(codeBlock->code + i, offsets);
+      if (size > sizes[i]) {
+	sizes[i] = size;
+	changed = 1;
+      }
+    }
+    for (i = 0; i < n; i ++) {
+      if (offsets[i] > INT_MAX - sizes[i]) goto done;
+      offsets[i + 1] = offsets[i] + sizes[i];
+    }
+  } while (changed);
+
+  initSection(compact);
+  compact->data = (char*) malloc(offsets[n] > 0 ? offsets[n] : 1);
+  if (compact->data == NULL) goto done;
+  compact->size = offsets[n];
+  compact->maxSize = offsets[n];
+
+  out = (unsigned char*) compact->data;
+  for (i = 0; i < n; i ++) {
+    Instruction* inst = codeBlock->code + i;
+    int operands = operandsOf(inst->op);
+
+    *out++ = (unsigned char) inst->op;
+    if (operands & OPERAND_P) out = putVarint(out, inst->p);
+    if (operands & OPERAND_TARGET) out = putVarint(out, offsets[inst->q]);
+    else if (operands & OPERAND_Q) out = putVarint(out, inst->q);
+  }
+  ok = 1;
+
+ done:
+  free(offsets);
+  free(sizes);
+  return ok;
+}
+
+int findOffset(int* offsets, int n, int offset) {
+  int low = 0, high = n;
+
+  while (low <= high) {
+    int mid = (low + high) / 2;
+    if (offsets[mid] == offset) return mid;
+    if (offsets[mid] < offset) low = mid + 1;
+    else high = mid - 1;
+  }
+  return -1;
+}
+
+// Decodes compact code into a fresh Instruction[] in the heap
+int decodeCode(CodeBlock* codeBlock, unsigned char* compact, int size) {
+  unsigned char* in = compact;
+  unsigned char* limit = compact + size;
+  Instruction* code;
+  int* offsets;
+  int n = 0, i;
+
+  // An instruction takes at least one byte
+  code = (Instruction*) malloc((size > 0 ? size : 1) * sizeof(Instruction));
+  offsets = (int*) malloc((size + 1) * sizeof(int));
+  if (code == NULL || offsets == NULL) goto fail;
+
+  while (in < limit) {
+    Instruction* inst = code + n;
+    int operands;
+
+    offsets[n] = in - compact;
+    if (*in > OP_BP) goto fail;
+    inst->op = (enum OpCode) *in++;
+    inst->p = DC_VALUE;
+    inst->q = DC_VALUE;
+    operands = operandsOf(inst->op);
+    if ((operands & OPERAND_P) && (in = getVarint(in, limit, &inst->p)) == NULL) goto fail;
+    if ((operands & OPERAND_Q) && (in = getVarint(in, limit, &inst->q)) == NULL) goto fail;
+    n ++;
+  }
+  offsets[n] = size;
+
+  for (i = 0; i < n; i ++) 
+    if (operandsOf(code[i].op) & OPERAND_TARGET) {
+      code[i].q = findOffset(offsets, n, code[i].q);
+      if (code[i].q < 0) goto fail;
+    }
+
+  free(offsets);
+  codeBlock->code = code;
+  codeBlock->codeSize = n;
+  codeBlock->maxSize = n;
+  return 1;
+
+ fail:
+  free(code);
+  free(offsets);
+  return 0;
+}
+
+// Reads a stream that cannot be mapped (a pipe, say) into the heap
+int readImage(CodeBlock* codeBlock, FILE* f) {
+  size_t capacity = READ_CHUNK_SIZE;
+  size_t n;
+
+  codeBlock->image = (char*) malloc(capacity);
+  if (codeBlock->image == NULL) return FALSE;
+  codeBlock->imageSize = 0;
+  codeBlock->mapped = 0;
+
+  while ((n = fread(codeBlock->image + codeBlock->imageSize, 1, 
+		    capacity - codeBlock->imageSize, f)) > 0) {
+    codeBlock->imageSize += n;
+    if (codeBlock->imageSize == capacity) {
+      char* buffer = (char*) realloc(codeBlock->image, capacity * 2);
+      if (buffer == NULL) return FALSE;
+      codeBlock->image = buffer;
+      capacity *= 2;
+    }
+  }
+  return !ferror(f);
+}
+
+int loadImage(CodeBlock* codeBlock, FILE* f) {
+#ifndef _WIN32
+  struct stat st;
+
+  if ((fstat(fileno(f), &st) == 0) && S_ISREG(st.st_mode)) {
+    void* image;
+
+    if (st.st_size == 0) return TRUE;
+    image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fileno(f), 0);
+    if (image == MAP_FAILED) return FALSE;
+    codeBlock->image = (char*) image;
+    codeBlock->imageSize = st.st_size;
+    codeBlock->mapped = 1;
+    return TRUE;
+  }
+#endif
+  return readImage(codeBlock, f);
+}
+
+// Points a table at a section of the image once its bounds are checked
+int useSection(CodeBlock* codeBlock, SectionHeader* header, Section* section, int itemSize) {
+  if ((header->offset % SECTION_ALIGNMENT != 0) || 
+      (header->offset > codeBlock->imageSize) ||
+      (header->size > codeBlock->imageSize - header->offset) ||
+      (header->size > INT_MAX) ||
+      (header->size % itemSize != 0))
+    return FALSE;
+  section->data = codeBlock->image + header->offset;
+  section->size = header->size;
+  section->maxSize = 0;
+  return TRUE;
+}
+
+int validString(CodeBlock* codeBlock, WORD offset) {
+  return (offset >= 0) && (offset < codeBlock->strings.size);
+}
+
+int useCodeFile(CodeBlock* codeBlock) {
+  CodeFileHeader* header = (CodeFileHeader*) codeBlock->image;
+  SectionHeader* sections = (SectionHeader*) (header + 1);
+  Section code;
+  int compact = 0;
+  int i;
+
+  if ((header->version != CODE_FILE_VERSION) ||
+      (header->byteOrder != CODE_FILE_BYTE_ORDER) ||
+      (header->instructionSize != sizeof(Instruction)) ||
+      (header->numOfSections > MAX_SECTIONS) ||
+      (codeBlock->imageSize < sizeof(CodeFileHeader) + header->numOfSections * sizeof(SectionHeader)))
+    return FALSE;
+
+  initSection(&code);
+  for (i = 0; i < header->numOfSections; i ++) {
+    Section* section;
+    int itemSize;
+
+    switch (sections[i].kind) {
+    case SECTION_CODE: 
+      compact = sections[i].flags & SECTION_COMPACT;
+      section = compact ? &codeBlock->compact : &code; 
+      itemSize = compact ? 1 : sizeof(Instruction); 
+      break;
+    case SECTION_CONSTANTS: section = &codeBlock->constants; itemSize = sizeof(ConstantEntry); break;
+    case SECTION_PROCEDURES: section = &codeBlock->procedures; itemSize = sizeof(ProcedureEntry); break;
+    case SECTION_LINES: section = &codeBlock->lines; itemSize = sizeof(LineEntry); break;
+    case SECTION_STRINGS: section = &codeBlock->strings; itemSize = 1; break;
+    default: continue;
+    }
+    if (!useSection(codeBlock, sections + i, section, itemSize)) 
+      return FALSE;
+  }
+
+  if (compact) {
+    if (!decodeCode(codeBlock, (unsigned char*) codeBlock->compact.data, codeBlock->compact.size))
+      return FALSE;
+  } else {
+    codeBlock->code = (Instruction*) code.data;
+    codeBlock->codeSize = code.size / sizeof(Instruction);
+    codeBlock->maxSize = codeBlock->codeSize;
+  }
+  codeBlock->entry = header->entry;
+  if ((codeBlock->entry < 0) || (codeBlock->entry > codeBlock->codeSize))
+    return FALSE;
+
+  // Names are only checked once, so tools can print them without care
+  if ((codeBlock->strings.size > 0) && 
+      (codeBlock->strings.data[codeBlock->strings.size - 1] != '\0'))
+    return FALSE;
+  for (i = 0; i < NUM_OF_CONSTANTS(codeBlock); i ++)
+    if (!validString(codeBlock, CONSTANT_ENTRY(codeBlock, i)->name)) return FALSE;
+  for (i = 0; i < NUM_OF_PROCEDURES(codeBlock); i ++)
+    if (!validString(codeBlock, PROCEDURE_ENTRY(codeBlock, i)->name)) return FALSE;
+  return TRUE;
+}
+
+/* Loads a compiled program. A regular file is mapped read-only and its
+ * sections are used in place, so nothing is copied, pages are only
+ * touched when they are used, and processes running the same program
+ * share them. Returns FALSE if the file is malformed or cannot be read. */
+int loadCode(CodeBlock* codeBlock, FILE* f) {
+  releaseCode(codeBlock);
+  if (!loadImage(codeBlock, f)) {
+    releaseCode(codeBlock);
+    return FALSE;
+  }
+
+  if ((codeBlock->imageSize >= sizeof(CodeFileHeader)) &&
+      (memcmp(codeBlock->image, CODE_FILE_MAGIC, 4) == 0)) {
+    if (useCodeFile(codeBlock)) return TRUE;
+  } else if ((codeBlock->imageSize % sizeof(Instruction) == 0) &&
+	     (codeBlock->imageSize / sizeof(Instruction) <= INT_MAX)) {
+    // A bare Instruction[] as written by saveCode
+    codeBlock->code = (Instruction*) codeBlock->image;
+    codeBlock->codeSize = codeBlock->imageSize / sizeof(Instruction);
+    codeBlock->maxSize = codeBlock->codeSize;
+    return TRUE;
+  }
+
+  releaseCode(codeBlock);
+  return FALSE;
+}
+
+int saveCode(CodeBlock* codeBlock, FILE* f) {
+  return fwrite(codeBlock->code, sizeof(Instruction), codeBlock->codeSize, f) == (size_t) codeBlock->codeSize;
+}
+
+int writePadding(FILE* f, long offset) {
+  static char zeros[SECTION_ALIGNMENT];
+  int padding = (SECTION_ALIGNMENT - offset % SECTION_ALIGNMENT) % SECTION_ALIGNMENT;
+  return fwrite(zeros, 1, padding, f) == (size_t) padding;
+}
+
+int saveCodeFile(CodeBlock* codeBlock, FILE* f, int flags) {
+  CodeFileHeader header;
+  SectionHeader sections[MAX_SECTIONS];
+  void* data[MAX_SECTIONS];
+  Section compact;
+  long offset;
+  int i, n = 0, ok = FALSE;
+
+#define ADD_SECTION(k, d, s)  do { sections[n].kind = (k); sections[n].flags = 0; \
+    sections[n].size = (s); data[n] = (d); n ++; } while (0)
+
+  initSection(&compact);
+  if (flags & SECTION_COMPACT) {
+    if (!encodeCode(codeBlock, &compact)) return FALSE;
+    ADD_SECTION(SECTION_CODE, compact.data, compact.size);
+    sections[0].flags = SECTION_COMPACT;
+  } else ADD_SECTION(SECTION_CODE, codeBlock->code, codeBlock->codeSize * sizeof(Instruction));
+  if (codeBlock->constants.size > 0)
+    ADD_SECTION(SECTION_CONSTANTS, codeBlock->constants.data, codeBlock->constants.size);
+  if (codeBlock->procedures.size > 0)
+    ADD_SECTION(SECTION_PROCEDURES, codeBlock->procedures.data, codeBlock->procedures.size);
+  if (codeBlock->lines.size > 0)
+    ADD_SECTION(SECTION_LINES, codeBlock->lines.data, codeBlock->lines.size);
+  if (codeBlock->strings.size > 0)
+    ADD_SECTION(SECTION_STRINGS, codeBlock->strings.data, codeBlock->strings.size);
+
+#undef ADD_SECTION
+
+  offset = sizeof(CodeFileHeader) + n * sizeof(SectionHeader);
+  for (i = 0; i < n; i ++) {
+    offset += (SECTION_ALIGNMENT - offset % SECTION_ALIGNMENT) % SECTION_ALIGNMENT;
+    sections[i].offset = offset;
+    offset += sections[i].size;
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CODE_FILE_MAGIC, 4);
+  header.version = CODE_FILE_VERSION;
+  header.numOfSections = n;
+  header.byteOrder = CODE_FILE_BYTE_ORDER;
+  header.instructionSize = sizeof(Instruction);
+  header.entry = codeBlock->entry;
+
+  if ((fwrite(&header, sizeof(header), 1, f) != 1) ||
+      (fwrite(sections, sizeof(SectionHeader), n, f) != (size_t) n))
+    goto done;
+  offset = sizeof(CodeFileHeader) + n * sizeof(SectionHeader);
+  for (i = 0; i < n; i ++) {
+    if (!writePadding(f, offset)) goto done;
+    if (fwrite(data[i], 1, sections[i].size, f) != sections[i].size) goto done;
+    offset = sections[i].offset + sections[i].size;
+  }
+  ok = TRUE;
 
-void saveCode(CodeBlock* codeBlock, FILE* f) {
-  fwrite(codeBlock->code, sizeof(Instruction), codeBlock->codeSize, f);
+ done:
+  free(compact.data);
+  return ok;
 }
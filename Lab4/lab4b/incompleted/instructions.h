@@ -8,6 +8,7 @@
 #define __INSTRUCTIONS_H__
 
 #include <stdio.h>
+#include <stdint.h>
 
 #define TRUE 1
 #define FALSE 0
@@ -17,6 +18,8 @@
 
 typedef int WORD;
 
+#define DISPLAY_SIZE 64   // lexical levels LAD, LVD, DSP and DRS can refer to
+
 enum OpCode {
   OP_LA,   // Load Address:    t := t + 1; s[t] := base(p) + q;
   OP_LV,   // Load Value:      t := t + 1; s[t] := s[base(p) + q];
@@ -49,6 +52,45 @@ enum OpCode {
   OP_GE,   // Greater or Equal t := t - 1;  if s[t] >= s[t+1] then s[t] := 1 else s[t] := 0;
   OP_LE,   // Less or Equal    t := t - 1;  if s[t] >= s[t+1] then s[t] := 1 else s[t] := 0;
 
+  // Superinstructions, emitted by codegen for common sequences
+  OP_ADI,  // Add Immediate    s[t] := s[t] + q;                               (LC q; AD)
+  OP_LV2,  // Load Local Pair  s[t+1] := s[b+p]; s[t+2] := s[b+q]; t := t + 2; (LV 0,p; LV 0,q)
+  OP_LVI,  // Load Value Ind.  t := t + 1; s[t] := s[s[base(p) + q]];          (LV p,q; LI)
+  OP_STV,  // Store Variable   s[base(p) + q] := s[t]; t := t - 1;             (LA p,q; ...; ST)
+  OP_INC,  // Increment        s[s[t]] := s[s[t]] + q;                         (CV; CV; LI; LC q; AD; ST)
+  OP_INCL, // Increment Local  s[b+p] := s[b+p] + q;                           (LA 0,p; LV 0,p; LC q; AD; ST)
+
+  // Compare and branch, emitted for conditions that feed a FJ
+  OP_JEQ,  // Jump if Equal    if s[t-1] = s[t] then pc := q; t := t - 2;      (NE; FJ q)
+  OP_JNE,  // Jump if Not Eq.  if s[t-1] != s[t] then pc := q; t := t - 2;     (EQ; FJ q)
+  OP_JGT,  // Jump if Greater  if s[t-1] > s[t] then pc := q; t := t - 2;      (LE; FJ q)
+  OP_JLT,  // Jump if Less     if s[t-1] < s[t] then pc := q; t := t - 2;      (GE; FJ q)
+  OP_JGE,  // Jump if Gr. or Eq. if s[t-1] >= s[t] then pc := q; t := t - 2;   (LT; FJ q)
+  OP_JLE,  // Jump if Le. or Eq. if s[t-1] <= s[t] then pc := q; t := t - 2;   (GT; FJ q)
+
+  // Counted loops: s[t-1] is the address of the control variable, s[t] the limit
+  OP_FORI, // For Init         if s[s[t-1]] > s[t] then begin t := t - 2; pc := q end;
+  OP_FORN, // For Next         s[s[t-1]] := s[s[t-1]] + 1; 
+           //                  if s[s[t-1]] <= s[t] then pc := q else t := t - 2;
+
+  // Multiplication and division by constants
+  OP_SHL,  // Shift Left       s[t] := s[t] * 2^q;                             (LC 2^q; ML)
+  OP_SHR,  // Shift Right      s[t] := s[t] / 2^q, by shifts;                  (LC 2^q; DV)
+  OP_DVM,  // Divide by Magic  s[t] := s[t] / d, for the d with magic number q
+           //                  and shift p, by a multiplication;               (LC d; DV)
+
+  // Non-local access through the display d, which holds the frame of the
+  // procedure at each lexical level p of the static chain
+  OP_LAD,  // Load Address D.  t := t + 1; s[t] := d[p] + q;                   (LA with base(p))
+  OP_LVD,  // Load Value D.    t := t + 1; s[t] := s[d[p] + q];                (LV with base(p))
+  OP_DSP,  // Set Display      s[b+3] := d[p]; d[p] := b;  on entry, in place of the static link
+  OP_DRS,  // Restore Display  d[p] := s[b+3];             before EP or EF
+
+  // Superinstructions for array elements and comparisons with a constant
+  OP_IXA,  // Index Address    t := t - 1; s[t] := s[t] + s[t+1] * q;          (LC q; ML; AD)
+  OP_LIX,  // Load Indexed     t := t - 1; s[t] := s[s[t] + s[t+1] * q];       (IXA q; LI)
+  OP_LVC,  // Load Local, Const s[t+1] := s[b+p]; s[t+2] := q; t := t + 2;     (LV 0,p; LC q)
+
   OP_BP    // Break point. Just for debugging
 };
 
@@ -61,19 +103,131 @@ struct Instruction_ {
 typedef struct Instruction_ Instruction;
 typedef int CodeAddress;
 
+/* Sectioned bytecode file.
+ *
+ * A header is followed by a table of section headers and by the
+ * sections themselves, each starting at a multiple of SECTION_ALIGNMENT
+ * from the beginning of the file. Sections are stored in the layout of
+ * the compiling host (recorded in the header), so a loader maps the file
+ * and uses them in place. Loaders skip sections they do not know.
+ */
+
+#define CODE_FILE_MAGIC "KPLB"
+#define CODE_FILE_VERSION 1
+#define CODE_FILE_BYTE_ORDER 0x01020304
+#define SECTION_ALIGNMENT 16
+
+// Section flags
+#define SECTION_COMPACT 1   // code in the compact encoding below
+
+/* Compact code encoding.
+ *
+ * Each instruction is a one byte opcode followed only by the operands it
+ * uses, p then q, each a zigzag encoded LEB128 varint. Jump and call
+ * targets are byte offsets in the encoded code; the other sections keep
+ * instruction indices. 
+ */
+
+enum SectionKind {
+  SECTION_CODE = 1,   // Instruction[]
+  SECTION_CONSTANTS,  // ConstantEntry[]
+  SECTION_PROCEDURES, // ProcedureEntry[], inner procedures first, the program last
+  SECTION_LINES,      // LineEntry[] in address order, debug information
+  SECTION_STRINGS     // NUL terminated names referred to by the other sections
+};
+
+struct CodeFileHeader_ {
+  char magic[4];
+  uint16_t version;
+  uint16_t numOfSections;
+  uint32_t byteOrder;        // CODE_FILE_BYTE_ORDER as stored by the writer
+  uint32_t instructionSize;  // sizeof(Instruction) of the writer
+  int32_t entry;             // code address where execution starts
+  uint32_t reserved;
+};
+
+struct SectionHeader_ {
+  uint32_t kind;
+  uint32_t flags;
+  uint32_t offset;
+  uint32_t size;             // in bytes
+};
+
+struct ConstantEntry_ {
+  WORD name;                 // offset in the string section
+  WORD value;
+};
+
+struct ProcedureEntry_ {
+  WORD name;
+  CodeAddress codeAddress;
+  WORD level;                // nesting level, 0 for the program
+  WORD numOfParams;
+  WORD frameSize;
+};
+
+struct LineEntry_ {
+  CodeAddress codeAddress;   // first instruction generated for the line
+  WORD lineNo;
+};
+
+typedef struct CodeFileHeader_ CodeFileHeader;
+typedef struct SectionHeader_ SectionHeader;
+typedef struct ConstantEntry_ ConstantEntry;
+typedef struct ProcedureEntry_ ProcedureEntry;
+typedef struct LineEntry_ LineEntry;
+
+// A table built by the compiler, or a view of a section of a loaded file
+struct Section_ {
+  char* data;
+  int size;         // in bytes
+  int maxSize;      // 0 when data lives in a loaded file
+};
+
+typedef struct Section_ Section;
+
+#define NUM_OF_CONSTANTS(block) ((block)->constants.size / (int) sizeof(ConstantEntry))
+#define NUM_OF_PROCEDURES(block) ((block)->procedures.size / (int) sizeof(ProcedureEntry))
+#define NUM_OF_LINES(block) ((block)->lines.size / (int) sizeof(LineEntry))
+#define CONSTANT_ENTRY(block, i) (((ConstantEntry*) (block)->constants.data) + (i))
+#define PROCEDURE_ENTRY(block, i) (((ProcedureEntry*) (block)->procedures.data) + (i))
+#define LINE_ENTRY(block, i) (((LineEntry*) (block)->lines.data) + (i))
+#define SECTION_STRING(block, offset) ((block)->strings.data + (offset))
+
 struct CodeBlock_ {
   Instruction* code;
   int codeSize;
-  int maxSize;
+  int maxSize;      // current capacity; the buffer grows on demand
+  CodeAddress entry;
+
+  // Optional tables, only kept by the sectioned file format
+  Section compact;  // the encoded code of a file loaded in the compact encoding
+  Section constants;
+  Section procedures;
+  Section lines;
+  Section strings;
+
+  // The file the block was loaded from; code and tables point into it
+  char* image;
+  size_t imageSize;
+  int mapped;       // the image is a read-only mapping rather than heap memory
 };
 
 typedef struct CodeBlock_ CodeBlock;
 
-CodeBlock* createCodeBlock(int maxSize);
+CodeBlock* createCodeBlock(int initialSize);
 void freeCodeBlock(CodeBlock* codeBlock);
 
 int emitCode(CodeBlock* codeBlock, enum OpCode op, WORD p, WORD q);
 
+#define OPERAND_P 1
+#define OPERAND_Q 2
+#define OPERAND_TARGET 4    // q is a code address
+
+int operandsOf(enum OpCode op);
+int encodeCode(CodeBlock* codeBlock, Section* compact);
+int decodeCode(CodeBlock* codeBlock, unsigned char* compact, int size);
+
 int emitLA(CodeBlock* codeBlock, WORD p, WORD q);
 int emitLV(CodeBlock* codeBlock, WORD p, WORD q);
 int emitLC(CodeBlock* codeBlock, WORD q);
@@ -105,12 +259,47 @@ int emitLT(CodeBlock* codeBlock);
 int emitGE(CodeBlock* codeBlock);
 int emitLE(CodeBlock* codeBlock);
 
+int emitADI(CodeBlock* codeBlock, WORD q);
+int emitLV2(CodeBlock* codeBlock, WORD p, WORD q);
+int emitLVI(CodeBlock* codeBlock, WORD p, WORD q);
+int emitSTV(CodeBlock* codeBlock, WORD p, WORD q);
+int emitINC(CodeBlock* codeBlock, WORD q);
+int emitINCL(CodeBlock* codeBlock, WORD p, WORD q);
+int emitJEQ(CodeBlock* codeBlock, WORD q);
+int emitJNE(CodeBlock* codeBlock, WORD q);
+int emitJGT(CodeBlock* codeBlock, WORD q);
+int emitJLT(CodeBlock* codeBlock, WORD q);
+int emitJGE(CodeBlock* codeBlock, WORD q);
+int emitJLE(CodeBlock* codeBlock, WORD q);
+int emitFORI(CodeBlock* codeBlock, WORD q);
+int emitFORN(CodeBlock* codeBlock, WORD q);
+int emitSHL(CodeBlock* codeBlock, WORD q);
+int emitSHR(CodeBlock* codeBlock, WORD q);
+int emitDVM(CodeBlock* codeBlock, WORD p, WORD q);
+int emitLAD(CodeBlock* codeBlock, WORD p, WORD q);
+int emitLVD(CodeBlock* codeBlock, WORD p, WORD q);
+int emitDSP(CodeBlock* codeBlock, WORD p);
+int emitDRS(CodeBlock* codeBlock, WORD p);
+int emitIXA(CodeBlock* codeBlock, WORD q);
+int emitLIX(CodeBlock* codeBlock, WORD q);
+int emitLVC(CodeBlock* codeBlock, WORD p, WORD q);
+
 int emitBP(CodeBlock* codeBlock);
 
 void printInstruction(Instruction* instruction);
 void printCodeBlock(CodeBlock* codeBlock);
 
-void loadCode(CodeBlock* codeBlock, FILE* f);
-void saveCode(CodeBlock* codeBlock, FILE* f);
+int addConstantEntry(CodeBlock* codeBlock, char* name, WORD value);
+int addProcedureEntry(CodeBlock* codeBlock, char* name, CodeAddress codeAddress, 
+		      int level, int numOfParams, int frameSize);
+int addLineEntry(CodeBlock* codeBlock, CodeAddress codeAddress, int lineNo);
+ProcedureEntry* findProcedureEntry(CodeBlock* codeBlock, char* name);
+
+// Accepts both the sectioned format and a bare Instruction[]
+int loadCode(CodeBlock* codeBlock, FILE* f);
+// Writes a bare Instruction[]
+int saveCode(CodeBlock* codeBlock, FILE* f);
+// Writes the sectioned format; flags are SECTION_* flags for the code
+int saveCodeFile(CodeBlock* codeBlock, FILE* f, int flags);
 
 #endif
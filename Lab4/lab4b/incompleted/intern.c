@@ -0,0 +1,112 @@
+/* 
+ * @copyright (c) 2008, Hedspi, Hanoi University of Technology
+ * @author Huu-Duc Nguyen
+ * @version 1.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "intern.h"
+
+#define INITIAL_TABLE_SIZE 256
+#define POOL_CHUNK_SIZE 4096
+
+struct InternEntry_ {
+  char *string;
+  unsigned hash;
+};
+
+typedef struct InternEntry_ InternEntry;
+
+// Interned strings are packed into large chunks, so interning does not
+// malloc once per identifier.
+struct PoolChunk_ {
+  struct PoolChunk_ *next;
+  int used;
+  char data[POOL_CHUNK_SIZE];
+};
+
+typedef struct PoolChunk_ PoolChunk;
+
+InternEntry *internTable = NULL;
+int internTableSize = 0;
+int internCount = 0;
+PoolChunk *stringPool = NULL;
+
+unsigned hashString(char *string, int length) {
+  unsigned h = 2166136261u;
+  int i;
+  for (i = 0; i < length; i++) {
+    h ^= (unsigned char) string[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+char* copyToPool(char *string, int length) {
+  char *s;
+
+  if ((stringPool == NULL) || (stringPool->used + length + 1 > POOL_CHUNK_SIZE)) {
+    PoolChunk *chunk = (PoolChunk*) malloc(sizeof(PoolChunk));
+    chunk->next = stringPool;
+    chunk->used = 0;
+    stringPool = chunk;
+  }
+  s = stringPool->data + stringPool->used;
+  memcpy(s, string, length);
+  s[length] = '\0';
+  stringPool->used += length + 1;
+  return s;
+}
+
+void growInternTable(void) {
+  InternEntry *oldTable = internTable;
+  int oldSize = internTableSize;
+  int i, j;
+
+  internTableSize = (oldSize == 0) ? INITIAL_TABLE_SIZE : oldSize * 2;
+  internTable = (InternEntry*) calloc(internTableSize, sizeof(InternEntry));
+  for (i = 0; i < oldSize; i++)
+    if (oldTable[i].string != NULL) {
+      j = oldTable[i].hash & (internTableSize - 1);
+      while (internTable[j].string != NULL)
+	j = (j + 1) & (internTableSize - 1);
+      internTable[j] = oldTable[i];
+    }
+  free(oldTable);
+}
+
+char* internString(char *string, int length) {
+  unsigned h;
+  int i;
+
+  if (2 * (internCount + 1) > internTableSize)
+    growInternTable();
+
+  h = hashString(string, length);
+  i = h & (internTableSize - 1);
+  while (internTable[i].string != NULL) {
+    if ((internTable[i].hash == h) && 
+	(strncmp(internTable[i].string, string, length) == 0) &&
+	(internTable[i].string[length] == '\0'))
+      return internTable[i].string;
+    i = (i + 1) & (internTableSize - 1);
+  }
+
+  internTable[i].string = copyToPool(string, length);
+  internTable[i].hash = h;
+  internCount ++;
+  return internTable[i].string;
+}
+
+void cleanInternTable(void) {
+  while (stringPool != NULL) {
+    PoolChunk *chunk = stringPool;
+    stringPool = chunk->next;
+    free(chunk);
+  }
+  free(internTable);
+  internTable = NULL;
+  internTableSize = 0;
+  internCount = 0;
+}
@@ -0,0 +1,15 @@
+/* 
+ * @copyright (c) 2008, Hedspi, Hanoi University of Technology
+ * @author Huu-Duc Nguyen
+ * @version 1.0
+ */
+
+#ifndef __INTERN_H__
+#define __INTERN_H__
+
+// Identifiers are interned: equal names always come back as the same
+// pointer, so they can be compared with == instead of strcmp.
+char* internString(char *string, int length);
+void cleanInternTable(void);
+
+#endif
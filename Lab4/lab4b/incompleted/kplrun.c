@@ -0,0 +1,117 @@
+/*
+ * @copyright (c) 2008, Hedspi, Hanoi University of Technology
+ * @author Huu-Duc Nguyen
+ * @version 1.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "instructions.h"
+#include "vm.h"
+
+int dumpCode = 0;
+int showStats = 0;
+int plainCode = 0;
+int cacheTop = 1;
+int stackSize = DEFAULT_STACK_SIZE;
+
+void printUsage(void) {
+  printf("Usage: kplrun input [-stack size] [-plain] [-nocache] [-dump] [-stats]\n");
+  printf("   input: program compiled by kplc\n");
+  printf("   -stack: stack size in words\n");
+  printf("   -plain: run the loaded code without translating it\n");
+  printf("   -nocache: keep the top of the stack in memory\n");
+  printf("   -dump: code dump\n");
+  printf("   -stats: dispatch and timing statistics\n");
+}
+
+double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/******************************************************************/
+
+int main(int argc, char *argv[]) {
+  CodeBlock* codeBlock;
+  ThreadedCode* threadedCode = NULL;
+  VM* vm;
+  double start, translation = 0, execution;
+  FILE* f;
+  enum VMStatus status;
+  int i;
+
+  if (argc <= 1) {
+    printf("kplrun: no input file.\n");
+    printUsage();
+    return -1;
+  }
+
+  for (i = 2; i < argc; i ++) {
+    if (strcmp(argv[i], "-dump") == 0) dumpCode = 1;
+    else if (strcmp(argv[i], "-stats") == 0) showStats = 1;
+    else if (strcmp(argv[i], "-plain") == 0) plainCode = 1;
+    else if (strcmp(argv[i], "-nocache") == 0) cacheTop = 0;
+    else if ((strcmp(argv[i], "-stack") == 0) && (i + 1 < argc)) stackSize = atoi(argv[++ i]);
+    else {
+      printUsage();
+      return -1;
+    }
+  }
+
+  f = fopen(argv[1], "rb");
+  if (f == NULL) {
+    printf("Can\'t read input file!\n");
+    return -1;
+  }
+  codeBlock = createCodeBlock(1);
+  if (!loadCode(codeBlock, f)) {
+    fclose(f);
+    printf("Invalid code file!\n");
+    return -1;
+  }
+  fclose(f);
+
+  if (dumpCode) printCodeBlock(codeBlock);
+
+  vm = createVM(stackSize);
+  if (vm == NULL) {
+    printf("Not enough memory for the stack!\n");
+    return -1;
+  }
+
+  if (!plainCode) {
+    start = now();
+    threadedCode = translateCode(codeBlock, cacheTop);
+    translation = now() - start;
+    if (threadedCode == NULL) {
+      printf("Invalid code file!\n");
+      return -1;
+    }
+  }
+
+  start = now();
+  if (plainCode)
+    status = runCode(vm, codeBlock);
+  else status = runThreaded(vm, threadedCode);
+  execution = now() - start;
+
+  if (status != VM_HALTED)
+    fprintf(stderr, "kplrun: %s (pc = %d, t = %d, b = %d)\n",
+	    vmStatusMessage(status), vm->pc, vm->t, vm->b);
+  if (showStats) {
+    fprintf(stderr, "%lld instructions dispatched\n", vm->dispatches);
+    if (!plainCode)
+      fprintf(stderr, "Translation: %.3f ms\n", translation * 1e3);
+    fprintf(stderr, "Execution: %.3f ms\n", execution * 1e3);
+  }
+
+  if (threadedCode != NULL) freeThreadedCode(threadedCode);
+  freeVM(vm);
+  freeCodeBlock(codeBlock);
+  return (status == VM_HALTED) ? 0 : -1;
+}
@@ -11,15 +11,37 @@
 #include "reader.h"
 #include "parser.h"
 #include "codegen.h"
+#include "peephole.h"
+#include "arena.h"
 
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
 
 int dumpCode = 0;
+int showStats = 0;
 
 void printUsage(void) {
-  printf("Usage: kplc input output [-dump]\n");
+  printf("Usage: kplc input output [-dump] [-stats] [-sections] [-compact] [-g] [-O] [-f<optimization>]\n");
   printf("   input: input kpl program\n");
   printf("   output: executable\n");
   printf("   -dump: code dump\n");
+  printf("   -stats: memory statistics\n");
+  printf("   -sections: sectioned output with constant and procedure tables\n");
+  printf("   -compact: sectioned output with compact code\n");
+  printf("   -g: sectioned output with a line table\n");
+  printf("   -O: all optimizations below\n");
+  printf("   -fsuper: superinstructions\n");
+  printf("   -fbranch: fused compare and branch\n");
+  printf("   -frotate: loop conditions tested at the bottom\n");
+  printf("   -ffor: counted loop instructions for FOR statements\n");
+  printf("   -ffold: constant folding and algebraic identities\n");
+  printf("   -fstrength: strength reduction of * and / by constants\n");
+  printf("   -finduction: running element addresses for array walks in FOR loops, with -ffor\n");
+  printf("   -fdisplay: non-local variables through a display instead of static links\n");
+  printf("   -flift: lambda lifting of nested procedures, compiling the program twice\n");
+  printf("   -fpeephole: peephole pass over the generated code\n");
+  printf("   -fno-<rule>: leave out one peephole rule, see -stats for the rules\n");
 }
 
 int analyseParam(char* param) {
@@ -27,9 +49,85 @@ int analyseParam(char* param) {
     dumpCode = 1;
     return 1;
   } 
+  if (strcmp(param, "-stats") == 0) {
+    showStats = 1;
+    return 1;
+  }
+  if (strcmp(param, "-sections") == 0) {
+    if (outputFormat == FORMAT_BARE) outputFormat = FORMAT_SECTIONED;
+    return 1;
+  }
+  if (strcmp(param, "-O") == 0) {
+    optimizations = ~0;
+    return 1;
+  }
+  if (strcmp(param, "-fsuper") == 0) {
+    optimizations |= OPT_SUPER;
+    return 1;
+  }
+  if (strcmp(param, "-fbranch") == 0) {
+    optimizations |= OPT_BRANCH;
+    return 1;
+  }
+  if (strcmp(param, "-frotate") == 0) {
+    optimizations |= OPT_ROTATE;
+    return 1;
+  }
+  if (strcmp(param, "-ffor") == 0) {
+    optimizations |= OPT_FOR;
+    return 1;
+  }
+  if (strcmp(param, "-ffold") == 0) {
+    optimizations |= OPT_FOLD;
+    return 1;
+  }
+  if (strcmp(param, "-fstrength") == 0) {
+    optimizations |= OPT_STRENGTH;
+    return 1;
+  }
+  if (strcmp(param, "-finduction") == 0) {
+    optimizations |= OPT_INDUCTION;
+    return 1;
+  }
+  if (strcmp(param, "-fdisplay") == 0) {
+    optimizations |= OPT_DISPLAY;
+    return 1;
+  }
+  if (strcmp(param, "-flift") == 0) {
+    optimizations |= OPT_LIFT;
+    return 1;
+  }
+  if (strcmp(param, "-fpeephole") == 0) {
+    optimizations |= OPT_PEEPHOLE;
+    return 1;
+  }
+  if (strncmp(param, "-fno-", 5) == 0)
+    return enablePeepholeRule(param + 5, FALSE);
+  if (strcmp(param, "-compact") == 0) {
+    outputFormat = FORMAT_COMPACT;
+    return 1;
+  }
+  if (strcmp(param, "-g") == 0) {
+    genLineInfo = 1;
+    if (outputFormat == FORMAT_BARE) outputFormat = FORMAT_SECTIONED;
+    return 1;
+  }
   return 0;
 }
 
+void printStats(void) {
+  printf("Symbol table: %ld allocations in %ld malloc calls, %lu bytes used, %lu bytes reserved\n",
+	 arenaStats.allocations, arenaStats.chunks, 
+	 (unsigned long) arenaStats.bytes, (unsigned long) arenaStats.reserved);
+#ifndef _WIN32
+  {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+      printf("Peak RSS: %ld KB\n", usage.ru_maxrss);
+  }
+#endif
+}
+
 
 /******************************************************************/
 
@@ -53,17 +151,40 @@ int main(int argc, char *argv[]) {
 
   initCodeBuffer();
 
+  // The first pass only finds out what nested procedures need
+  if (optimizations & OPT_LIFT) {
+    if (compile(argv[1]) == IO_ERROR) {
+      printf("Can\'t read input file!\n");
+      return -1;
+    }
+    if (!liftProcedures()) {
+      printf("Not enough memory for lambda lifting!\n");
+      return -1;
+    }
+    cleanCodeBuffer();
+    initCodeBuffer();
+  }
+
   if (compile(argv[1]) == IO_ERROR) {
     printf("Can\'t read input file!\n");
     return -1;
   }
 
+  if ((optimizations & OPT_PEEPHOLE) && optimizeCodeBuffer() < 0) {
+    printf("Not enough memory for the peephole pass!\n");
+    return -1;
+  }
+
   if (serialize(argv[2]) == IO_ERROR) {
     printf("Can\'t write output file!\n");
     return -1;
   }
 
   if (dumpCode) printCodeBuffer();
+  if (showStats) {
+    printStats();
+    if (optimizations & OPT_PEEPHOLE) printPeepholeReport();
+  }
     
   cleanCodeBuffer();
 
@@ -13,6 +13,7 @@
 #include "error.h"
 #include "debug.h"
 #include "codegen.h"
+#include "intern.h"
 
 Token *currentToken;
 Token *lookAhead;
@@ -22,10 +23,8 @@ extern Type* charType;
 extern SymTab* symtab;
 
 void scan(void) {
-  Token* tmp = currentToken;
   currentToken = lookAhead;
   lookAhead = getValidToken();
-  free(tmp);
 }
 
 void eat(TokenType tokenType) {
@@ -41,7 +40,7 @@ void compileProgram(void) {
   eat(KW_PROGRAM);
   eat(TK_IDENT);
 
-  program = createProgramObject(currentToken->string);
+  program = createProgramObject(currentToken->ident);
   program->progAttrs->codeAddress = getCurrentCodeAddress();
   enterBlock(program->progAttrs->scope);
 
@@ -53,6 +52,7 @@ void compileProgram(void) {
   // Halt the program
   genHL();
 
+  recordProcedure(program);
   exitBlock();
 }
 
@@ -64,13 +64,14 @@ void compileConstDecls(void) {
     eat(KW_CONST);
     do {
       eat(TK_IDENT);
-      checkFreshIdent(currentToken->string);
-      constObj = createConstantObject(currentToken->string);
+      checkFreshIdent(currentToken->ident);
+      constObj = createConstantObject(currentToken->ident);
       declareObject(constObj);
       
       eat(SB_EQ);
       constValue = compileConstant();
       constObj->constAttrs->value = constValue;
+      recordConstant(constObj);
       
       eat(SB_SEMICOLON);
     } while (lookAhead->tokenType == TK_IDENT);
@@ -86,8 +87,8 @@ void compileTypeDecls(void) {
     do {
       eat(TK_IDENT);
       
-      checkFreshIdent(currentToken->string);
-      typeObj = createTypeObject(currentToken->string);
+      checkFreshIdent(currentToken->ident);
+      typeObj = createTypeObject(currentToken->ident);
       declareObject(typeObj);
       
       eat(SB_EQ);
@@ -107,8 +108,8 @@ void compileVarDecls(void) {
     eat(KW_VAR);
     do {
       eat(TK_IDENT);
-      checkFreshIdent(currentToken->string);
-      varObj = createVariableObject(currentToken->string);
+      checkFreshIdent(currentToken->ident);
+      varObj = createVariableObject(currentToken->ident);
       eat(SB_COLON);
       varType = compileType();
       varObj->varAttrs->type = varType;
@@ -119,7 +120,7 @@ void compileVarDecls(void) {
 }
 
 void compileBlock(void) {
-  Instruction* jmp;
+  CodeAddress jmp;
   // Jump to the body of the block
   jmp = genJ(DC_VALUE);
 
@@ -131,7 +132,7 @@ void compileBlock(void) {
   // Update the jmp label
   updateJ(jmp,getCurrentCodeAddress());
   // Skip the stack frame
-  genINT(symtab->currentScope->frameSize);
+  genFrame();
 
   eat(KW_BEGIN);
   compileStatements();
@@ -153,14 +154,15 @@ void compileFuncDecl(void) {
   eat(KW_FUNCTION);
   eat(TK_IDENT);
 
-  checkFreshIdent(currentToken->string);
-  funcObj = createFunctionObject(currentToken->string);
+  checkFreshIdent(currentToken->ident);
+  funcObj = createFunctionObject(currentToken->ident);
   funcObj->funcAttrs->codeAddress = getCurrentCodeAddress();
   declareObject(funcObj);
 
   enterBlock(funcObj->funcAttrs->scope);
   
   compileParams();
+  declareFreeParams();
 
   eat(SB_COLON);
   returnType = compileBasicType();
@@ -174,6 +176,7 @@ void compileFuncDecl(void) {
 
   eat(SB_SEMICOLON);
 
+  recordProcedure(funcObj);
   exitBlock();
 }
 
@@ -183,14 +186,15 @@ void compileProcDecl(void) {
   eat(KW_PROCEDURE);
   eat(TK_IDENT);
 
-  checkFreshIdent(currentToken->string);
-  procObj = createProcedureObject(currentToken->string);
+  checkFreshIdent(currentToken->ident);
+  procObj = createProcedureObject(currentToken->ident);
   procObj->procAttrs->codeAddress = getCurrentCodeAddress();
   declareObject(procObj);
 
   enterBlock(procObj->procAttrs->scope);
 
   compileParams();
+  declareFreeParams();
 
   eat(SB_SEMICOLON);
   compileBlock();
@@ -199,6 +203,7 @@ void compileProcDecl(void) {
 
   eat(SB_SEMICOLON);
 
+  recordProcedure(procObj);
   exitBlock();
 }
 
@@ -214,7 +219,7 @@ ConstantValue* compileUnsignedConstant(void) {
   case TK_IDENT:
     eat(TK_IDENT);
 
-    obj = checkDeclaredConstant(currentToken->string);
+    obj = checkDeclaredConstant(currentToken->ident);
     constValue = duplicateConstantValue(obj->constAttrs->value);
 
     break;
@@ -229,28 +234,81 @@ ConstantValue* compileUnsignedConstant(void) {
   return constValue;
 }
 
+// Constant expressions are evaluated as they are parsed, with the same
+// grammar and arithmetic as compileExpression; a sign applies to the
+// first term only
 ConstantValue* compileConstant(void) {
   ConstantValue* constValue;
 
   switch (lookAhead->tokenType) {
   case SB_PLUS:
     eat(SB_PLUS);
-    constValue = compileConstant2();
+    constValue = compileConstantTerm();
+    checkIntConstant(constValue);
     break;
   case SB_MINUS:
     eat(SB_MINUS);
-    constValue = compileConstant2();
-    constValue->intValue = - constValue->intValue;
-    break;
-  case TK_CHAR:
-    eat(TK_CHAR);
-    constValue = makeCharConstant(currentToken->string[0]);
+    constValue = compileConstantTerm();
+    checkIntConstant(constValue);
+    constValue->intValue = evaluate(OP_SB, 0, constValue->intValue);
     break;
   default:
-    constValue = compileConstant2();
+    constValue = compileConstantTerm();
     break;
   }
-  return constValue;
+  return compileConstant3(constValue);
+}
+
+ConstantValue* compileConstant3(ConstantValue* constValue) {
+  ConstantValue* operand;
+
+  switch (lookAhead->tokenType) {
+  case SB_PLUS:
+    eat(SB_PLUS);
+    checkIntConstant(constValue);
+    operand = compileConstantTerm();
+    checkIntConstant(operand);
+    constValue->intValue = evaluate(OP_AD, constValue->intValue, operand->intValue);
+    return compileConstant3(constValue);
+  case SB_MINUS:
+    eat(SB_MINUS);
+    checkIntConstant(constValue);
+    operand = compileConstantTerm();
+    checkIntConstant(operand);
+    constValue->intValue = evaluate(OP_SB, constValue->intValue, operand->intValue);
+    return compileConstant3(constValue);
+  default:
+    return constValue;
+  }
+}
+
+ConstantValue* compileConstantTerm(void) {
+  return compileConstantTerm2(compileConstant2());
+}
+
+ConstantValue* compileConstantTerm2(ConstantValue* constValue) {
+  ConstantValue* operand;
+
+  switch (lookAhead->tokenType) {
+  case SB_TIMES:
+    eat(SB_TIMES);
+    checkIntConstant(constValue);
+    operand = compileConstant2();
+    checkIntConstant(operand);
+    constValue->intValue = evaluate(OP_ML, constValue->intValue, operand->intValue);
+    return compileConstantTerm2(constValue);
+  case SB_SLASH:
+    eat(SB_SLASH);
+    checkIntConstant(constValue);
+    operand = compileConstant2();
+    checkIntConstant(operand);
+    if (operand->intValue == 0)
+      error(ERR_DIVISION_BY_ZERO, currentToken->lineNo, currentToken->colNo);
+    constValue->intValue = evaluate(OP_DV, constValue->intValue, operand->intValue);
+    return compileConstantTerm2(constValue);
+  default:
+    return constValue;
+  }
 }
 
 ConstantValue* compileConstant2(void) {
@@ -262,13 +320,19 @@ ConstantValue* compileConstant2(void) {
     eat(TK_NUMBER);
     constValue = makeIntConstant(currentToken->value);
     break;
+  case TK_CHAR:
+    eat(TK_CHAR);
+    constValue = makeCharConstant(currentToken->string[0]);
+    break;
   case TK_IDENT:
     eat(TK_IDENT);
-    obj = checkDeclaredConstant(currentToken->string);
-    if (obj->constAttrs->value->type == TP_INT)
-      constValue = duplicateConstantValue(obj->constAttrs->value);
-    else
-      error(ERR_UNDECLARED_INT_CONSTANT,currentToken->lineNo, currentToken->colNo);
+    obj = checkDeclaredConstant(currentToken->ident);
+    constValue = duplicateConstantValue(obj->constAttrs->value);
+    break;
+  case SB_LPAR:
+    eat(SB_LPAR);
+    constValue = compileConstant();
+    eat(SB_RPAR);
     break;
   default:
     error(ERR_INVALID_CONSTANT, lookAhead->lineNo, lookAhead->colNo);
@@ -277,6 +341,15 @@ ConstantValue* compileConstant2(void) {
   return constValue;
 }
 
+int compileArraySize(void) {
+  ConstantValue* size = compileConstant();
+
+  checkIntConstant(size);
+  if (size->intValue < 0)
+    error(ERR_INVALID_ARRAY_SIZE, currentToken->lineNo, currentToken->colNo);
+  return size->intValue;
+}
+
 Type* compileType(void) {
   Type* type;
   Type* elementType;
@@ -295,10 +368,7 @@ Type* compileType(void) {
   case KW_ARRAY:
     eat(KW_ARRAY);
     eat(SB_LSEL);
-    eat(TK_NUMBER);
-
-    arraySize = currentToken->value;
-
+    arraySize = compileArraySize();
     eat(SB_RSEL);
     eat(KW_OF);
     elementType = compileType();
@@ -306,7 +376,7 @@ Type* compileType(void) {
     break;
   case TK_IDENT:
     eat(TK_IDENT);
-    obj = checkDeclaredType(currentToken->string);
+    obj = checkDeclaredType(currentToken->ident);
     type = duplicateType(obj->typeAttrs->actualType);
     break;
   default:
@@ -358,8 +428,8 @@ void compileParam(void) {
   }
 
   eat(TK_IDENT);
-  checkFreshIdent(currentToken->string);
-  param = createParameterObject(currentToken->string, paramKind);
+  checkFreshIdent(currentToken->ident);
+  param = createParameterObject(currentToken->ident, paramKind);
   eat(SB_COLON);
   type = compileBasicType();
   param->paramAttrs->type = type;
@@ -412,11 +482,12 @@ Type* compileLValue(void) {
 
   eat(TK_IDENT);
   
-  var = checkDeclaredLValueIdent(currentToken->string);
+  var = checkDeclaredLValueIdent(currentToken->ident);
 
   switch (var->kind) {
   case OBJ_VARIABLE:
     // TODO: push the variable address onto the stack
+    noteAssignment(var);
     genVariableAddress(var);
 
     if (var->varAttrs->type->typeClass == TP_ARRAY) {
@@ -427,19 +498,15 @@ Type* compileLValue(void) {
       varType = var->varAttrs->type;
     break;
   case OBJ_PARAMETER:
-    if (var->paramAttrs->kind == PARAM_VALUE) {
-      int level = symtab->currentScope->outer == NULL ? 0 : 1;
-      int diff = level - (PARAMETER_SCOPE(var)->outer == NULL ? 0 : 1);
-      genLA(diff, PARAMETER_OFFSET(var));
-    } else {
-      int level = symtab->currentScope->outer == NULL ? 0 : 1;
-      int diff = level - (PARAMETER_SCOPE(var)->outer == NULL ? 0 : 1);
-      genLV(diff, PARAMETER_OFFSET(var));
-    }
+    noteAssignment(var);
+    if (var->paramAttrs->kind == PARAM_VALUE)
+      genLA(levelDifference(PARAMETER_SCOPE(var)), PARAMETER_OFFSET(var));
+    else
+      genLV(levelDifference(PARAMETER_SCOPE(var)), PARAMETER_OFFSET(var));
     varType = var->paramAttrs->type;
     break;
   case OBJ_FUNCTION:
-    genLA(0, RETURN_VALUE_OFFSET);
+    genLA(levelDifference(var->funcAttrs->scope), RETURN_VALUE_OFFSET);
     varType = var->funcAttrs->returnType;
     break;
   default: 
@@ -453,14 +520,17 @@ Type* compileLValue(void) {
 void compileAssignSt(void) {
   Type* varType;
   Type* expType;
+  CodeAddress lvalue, expression;
 
+  lvalue = getCurrentCodeAddress();
   varType = compileLValue();
   
   eat(SB_ASSIGN);
+  expression = getCurrentCodeAddress();
   expType = compileExpression();
   checkTypeEquality(varType, expType);
   
-  genST();
+  genAssign(lvalue, expression);
 }
 
 // TODO: Compile procedure call statement
@@ -470,18 +540,18 @@ void compileCallSt(void) {
   eat(KW_CALL);
   eat(TK_IDENT);
 
-  proc = checkDeclaredProcedure(currentToken->string);
+  proc = checkDeclaredProcedure(currentToken->ident);
 
   if (isPredefinedProcedure(proc)) {
     compileArguments(proc->procAttrs->paramList);
     genPredefinedProcedureCall(proc);
   } else {
+    noteCall(proc);
     genINT(4);
     compileArguments(proc->procAttrs->paramList);
-    int level = symtab->currentScope->outer == NULL ? 0 : 1;
-    int diff = level - (proc->procAttrs->scope->outer->outer == NULL ? 0 : 1);
-    genCALL(diff, proc->procAttrs->codeAddress);
-    genDCT(4 + proc->procAttrs->paramCount);
+    // Drop the arguments again; CALL builds the frame right above t
+    genDCT(4 + proc->procAttrs->paramCount + genFreeArguments(proc));
+    genCALL(levelDifference(proc->procAttrs->scope->outer), proc->procAttrs->codeAddress);
   }
 }
 
@@ -493,8 +563,8 @@ void compileGroupSt(void) {
 
 // TODO: Compile if-then-else statement
 void compileIfSt(void) {
-  Instruction* fjInst;
-  Instruction* jInst;
+  CodeAddress fjInst;
+  CodeAddress jInst;
 
   eat(KW_IF);
   compileCondition();
@@ -520,7 +590,10 @@ void compileIfSt(void) {
 // TODO: Compile while-do statement
 void compileWhileSt(void) {
   CodeAddress condAddr;
-  Instruction* fjInst;
+  CodeAddress fjInst;
+  CodeAddress jInst;
+  CodeAddress body;
+  CodeFragment* condition;
 
   eat(KW_WHILE);
   condAddr = getCurrentCodeAddress();
@@ -528,6 +601,20 @@ void compileWhileSt(void) {
   compileCondition();
   
   eat(KW_DO);
+  if (optimizations & OPT_ROTATE) {
+    // J cond; body: statement; cond: condition; TJ body
+    condition = cutCode(condAddr);
+    jInst = genJ(DC_VALUE);
+    body = getCurrentCodeAddress();
+
+    compileStatement();
+
+    updateJ(jInst, getCurrentCodeAddress());
+    pasteCode(condition);
+    genTJ(body);
+    return;
+  }
+
   fjInst = genFJ(DC_VALUE);
   
   compileStatement();
@@ -542,14 +629,21 @@ void compileForSt(void) {
   Type* varType;
   Type *type;
   CodeAddress loopStart;
-  Instruction* fjInst;
+  CodeAddress fjInst;
+  CodeAddress jInst;
+  CodeAddress body;
+  CodeFragment* limit = NULL;
+  CodeAddress limitStart;
   Object* controlVar;
+  Object* limitVar = NULL;
+  int lineNo, colNo;
 
   eat(KW_FOR);
 
   eat(TK_IDENT);
-  controlVar = checkDeclaredLValueIdent(currentToken->string);
+  controlVar = checkDeclaredLValueIdent(currentToken->ident);
   
+  noteAssignment(controlVar);
   genVariableAddress(controlVar); 
   genCV();
   
@@ -561,6 +655,33 @@ void compileForSt(void) {
   genST();
   
   eat(KW_TO);
+
+  if (optimizations & OPT_FOR) {
+    // The address and the limit stay on the stack for FORI and FORN
+    limitStart = getCurrentCodeAddress();
+    lineNo = lookAhead->lineNo;
+    colNo = lookAhead->colNo;
+    type = compileExpression();
+    checkTypeEquality(varType, type);
+
+    // A limit that is a single identifier
+    if (currentToken->tokenType == TK_IDENT && currentToken->lineNo == lineNo && currentToken->colNo == colNo) {
+      limitVar = checkDeclaredIdent(currentToken->ident);
+      if (!(limitVar->kind == OBJ_VARIABLE ||
+	    (limitVar->kind == OBJ_PARAMETER && limitVar->paramAttrs->kind == PARAM_VALUE)))
+	limitVar = NULL;
+    }
+
+    eat(KW_DO);
+    fjInst = genFORI(DC_VALUE);
+    body = getCurrentCodeAddress();
+    beginForLoop(controlVar, limitVar);
+
+    compileStatement();
+
+    endForLoop(limitStart, fjInst, body);
+    return;
+  }
   
   genCV();
   genLI();
@@ -572,7 +693,12 @@ void compileForSt(void) {
   genLE();
   
   eat(KW_DO);
-  fjInst = genFJ(DC_VALUE);
+  if (optimizations & OPT_ROTATE) {
+    // The limit test moves below the increment, as in compileWhileSt
+    limit = cutCode(loopStart);
+    jInst = genJ(DC_VALUE);
+  } else fjInst = genFJ(DC_VALUE);
+  body = getCurrentCodeAddress();
   
   compileStatement();
   
@@ -585,9 +711,14 @@ void compileForSt(void) {
   
   genCV();
   genLI();
-  genJ(loopStart);
-  
-  updateFJ(fjInst, getCurrentCodeAddress());
+  if (limit != NULL) {
+    updateJ(jInst, getCurrentCodeAddress());
+    pasteCode(limit);
+    genTJ(body);
+  } else {
+    genJ(loopStart);
+    updateFJ(fjInst, getCurrentCodeAddress());
+  }
   genDCT(1);
 }
 
@@ -715,17 +846,20 @@ void compileCondition(void) {
 Type* compileExpression(void) {
   Type* type;
   
+  // A sign applies to the first term only, so -a + b is (-a) + b
   switch (lookAhead->tokenType) {
   case SB_PLUS:
     eat(SB_PLUS);
-    type = compileExpression2();
+    type = compileTerm();
     checkIntType(type);
+    type = compileExpression3(type);
     break;
   case SB_MINUS:
     eat(SB_MINUS);
-    type = compileExpression2();
+    type = compileTerm();
     checkIntType(type);
     genNEG();
+    type = compileExpression3(type);
     break;
   default:
     type = compileExpression2();
@@ -867,7 +1001,7 @@ Type* compileFactor(void) {
     break;
   case TK_IDENT:
     eat(TK_IDENT);
-    obj = checkDeclaredIdent(currentToken->string);
+    obj = checkDeclaredIdent(currentToken->ident);
 
     switch (obj->kind) {
     case OBJ_CONSTANT:
@@ -895,16 +1029,8 @@ Type* compileFactor(void) {
       }
       break;
     case OBJ_PARAMETER:
-      if (obj->paramAttrs->kind == PARAM_VALUE) {
-	int level = symtab->currentScope->outer == NULL ? 0 : 1;
-	int diff = level - (PARAMETER_SCOPE(obj)->outer == NULL ? 0 : 1);
-	genLV(diff, PARAMETER_OFFSET(obj));
-      } else {
-	int level = symtab->currentScope->outer == NULL ? 0 : 1;
-	int diff = level - (PARAMETER_SCOPE(obj)->outer == NULL ? 0 : 1);
-	genLV(diff, PARAMETER_OFFSET(obj));
-	genLI();
-      }
+      genLV(levelDifference(PARAMETER_SCOPE(obj)), PARAMETER_OFFSET(obj));
+      if (obj->paramAttrs->kind == PARAM_REFERENCE) genLI();
       type = obj->paramAttrs->type;
       break;
     case OBJ_FUNCTION:
@@ -912,12 +1038,11 @@ Type* compileFactor(void) {
 	compileArguments(obj->funcAttrs->paramList);
 	genPredefinedFunctionCall(obj);
       } else {
+	noteCall(obj);
 	genINT(4);
 	compileArguments(obj->funcAttrs->paramList);
-	int level = symtab->currentScope->outer == NULL ? 0 : 1;
-	int diff = level - (obj->funcAttrs->scope->outer->outer == NULL ? 0 : 1);
-	genCALL(diff, obj->funcAttrs->codeAddress);
-	genDCT(3 + obj->funcAttrs->paramCount);
+	genDCT(4 + obj->funcAttrs->paramCount + genFreeArguments(obj));
+	genCALL(levelDifference(obj->funcAttrs->scope->outer), obj->funcAttrs->codeAddress);
       }
       type = obj->funcAttrs->returnType;
       break;
@@ -941,16 +1066,16 @@ Type* compileFactor(void) {
 // TODO
 Type* compileIndexes(Type* arrayType) {
   Type* type;
+  CodeAddress subscript;
 
   while (lookAhead->tokenType == SB_LSEL) {
     eat(SB_LSEL);
+    subscript = getCurrentCodeAddress();
     type = compileExpression();
     checkIntType(type);
     checkArrayType(arrayType);
 
-    genLC(sizeOfType(arrayType->elementType));
-    genML();
-    genAD();
+    genSubscript(subscript, sizeOfType(arrayType->elementType));
     
     arrayType = arrayType->elementType;
     eat(SB_RSEL);
@@ -971,8 +1096,10 @@ int compile(char *fileName) {
   compileProgram();
 
   cleanSymTab();
-  free(currentToken);
-  free(lookAhead);
+  cleanInternTable();
+  releaseTokens();
+  currentToken = NULL;
+  lookAhead = NULL;
   closeInputStream();
   return IO_SUCCESS;
 
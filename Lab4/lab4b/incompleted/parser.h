@@ -28,7 +28,11 @@ void compileFuncDecl(void);
 void compileProcDecl(void);
 ConstantValue* compileUnsignedConstant(void);
 ConstantValue* compileConstant(void);
+ConstantValue* compileConstant3(ConstantValue* constValue);
+ConstantValue* compileConstantTerm(void);
+ConstantValue* compileConstantTerm2(ConstantValue* constValue);
 ConstantValue* compileConstant2(void);
+int compileArraySize(void);
 Type* compileType(void);
 Type* compileBasicType(void);
 void compileParams(void);
@@ -0,0 +1,288 @@
+/*
+ * @copyright (c) 2008, Hedspi, Hanoi University of Technology
+ * @author Huu-Duc Nguyen
+ * @version 1.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "peephole.h"
+
+#define MAX_PASSES 16
+#define MAX_JUMP_CHAIN 16   // jumps followed when threading, in case of cycles
+
+int peepholePasses = 0;
+int peepholeRemoved = 0;
+
+/******************************************************************/
+
+// The first live instruction from at on, or codeSize
+CodeAddress liveFrom(Peephole* peephole, CodeAddress at) {
+  while (at < peephole->codeBlock->codeSize && peephole->deleted[at]) at ++;
+  return at;
+}
+
+CodeAddress nextLive(Peephole* peephole, CodeAddress at) {
+  return liveFrom(peephole, at + 1);
+}
+
+// The live instruction before at, or -1
+CodeAddress previousLive(Peephole* peephole, CodeAddress at) {
+  for (at --; at >= 0; at --)
+    if (!peephole->deleted[at]) return at;
+  return -1;
+}
+
+// Jumps to a deleted instruction land on the next live one, so a target
+// anywhere after from and up to to is a target of to
+int targetAfter(Peephole* peephole, CodeAddress from, CodeAddress to) {
+  for (from ++; from <= to; from ++)
+    if (peephole->target[from]) return TRUE;
+  return FALSE;
+}
+
+// The instruction after at, if control reaches it only from at
+Instruction* following(Peephole* peephole, CodeAddress at) {
+  CodeAddress next = nextLive(peephole, at);
+
+  if (next >= peephole->codeBlock->codeSize || targetAfter(peephole, at, next)) return NULL;
+  return peephole->codeBlock->code + next;
+}
+
+int isTerminator(Instruction* inst) {
+  switch (inst->op) {
+  case OP_J: case OP_HL: case OP_EP: case OP_EF: return TRUE;
+  default: return FALSE;
+  }
+}
+
+/******************************************************************/
+
+// J to the instruction that follows anyway
+int removeJumpToNext(Peephole* peephole, CodeAddress at) {
+  Instruction* inst = peephole->codeBlock->code + at;
+
+  if (inst->op != OP_J) return FALSE;
+  if (liveFrom(peephole, inst->q) != nextLive(peephole, at)) return FALSE;
+  peephole->deleted[at] = TRUE;
+  return TRUE;
+}
+
+// Jumps and calls to a J go to its target instead
+int threadJumps(Peephole* peephole, CodeAddress at) {
+  Instruction* code = peephole->codeBlock->code;
+  Instruction* inst = code + at;
+  CodeAddress start, target;
+  int n;
+
+  if (!(operandsOf(inst->op) & OPERAND_TARGET)) return FALSE;
+
+  start = target = liveFrom(peephole, inst->q);
+  for (n = 0; n < MAX_JUMP_CHAIN; n ++) {
+    if (target >= peephole->codeBlock->codeSize || code[target].op != OP_J) break;
+    if (liveFrom(peephole, code[target].q) == target) break;
+    target = liveFrom(peephole, code[target].q);
+  }
+  if (target == start || target == at) return FALSE;
+  inst->q = target;
+  return TRUE;
+}
+
+// J to HL, EP or EF stops right there
+int copyReturn(Peephole* peephole, CodeAddress at) {
+  Instruction* code = peephole->codeBlock->code;
+  CodeAddress target;
+
+  if (code[at].op != OP_J) return FALSE;
+  target = liveFrom(peephole, code[at].q);
+  if (target >= peephole->codeBlock->codeSize) return FALSE;
+  switch (code[target].op) {
+  case OP_HL: case OP_EP: case OP_EF:
+    code[at] = code[target];
+    return TRUE;
+  default:
+    return FALSE;
+  }
+}
+
+// Code after J, HL, EP or EF that nothing jumps to
+int removeDeadCode(Peephole* peephole, CodeAddress at) {
+  CodeAddress previous = previousLive(peephole, at);
+
+  if (previous < 0 || !isTerminator(peephole->codeBlock->code + previous)) return FALSE;
+  if (targetAfter(peephole, previous, at)) return FALSE;
+  peephole->deleted[at] = TRUE;
+  return TRUE;
+}
+
+// INT and DCT in a row add up; INT 0 and DCT 0 go
+int mergeStackAdjustments(Peephole* peephole, CodeAddress at) {
+  Instruction* inst = peephole->codeBlock->code + at;
+  Instruction* next;
+  WORD delta;
+
+  if (inst->op != OP_INT && inst->op != OP_DCT) return FALSE;
+  delta = (inst->op == OP_INT) ? inst->q : - inst->q;
+
+  next = following(peephole, at);
+  if (next != NULL && (next->op == OP_INT || next->op == OP_DCT)) {
+    delta += (next->op == OP_INT) ? next->q : - next->q;
+    peephole->deleted[next - peephole->codeBlock->code] = TRUE;
+  } else if (delta != 0) return FALSE;
+
+  if (delta == 0) peephole->deleted[at] = TRUE;
+  else if (delta > 0) {
+    inst->op = OP_INT;
+    inst->q = delta;
+  } else {
+    inst->op = OP_DCT;
+    inst->q = - delta;
+  }
+  return TRUE;
+}
+
+// LA p,q; LI loads the variable, like LV p,q
+int loadValue(Peephole* peephole, CodeAddress at) {
+  Instruction* inst = peephole->codeBlock->code + at;
+  Instruction* next;
+
+  if (inst->op != OP_LA) return FALSE;
+  next = following(peephole, at);
+  if (next == NULL || next->op != OP_LI) return FALSE;
+  inst->op = OP_LV;
+  peephole->deleted[next - peephole->codeBlock->code] = TRUE;
+  return TRUE;
+}
+
+PeepholeRule peepholeRules[] = {
+  {"jump-next", "J to the next instruction", removeJumpToNext, TRUE, 0},
+  {"jump-chain", "jumps and calls to a J", threadJumps, TRUE, 0},
+  {"jump-return", "J to HL, EP or EF", copyReturn, TRUE, 0},
+  {"dead-code", "unreachable instructions", removeDeadCode, TRUE, 0},
+  {"int-dct", "INT and DCT in a row, INT 0, DCT 0", mergeStackAdjustments, TRUE, 0},
+  {"la-li", "LA p,q; LI to LV p,q", loadValue, TRUE, 0},
+  {NULL, NULL, NULL, FALSE, 0}
+};
+
+int enablePeepholeRule(char* name, int enabled) {
+  PeepholeRule* rule;
+
+  for (rule = peepholeRules; rule->name != NULL; rule ++)
+    if (strcmp(rule->name, name) == 0) {
+      rule->enabled = enabled;
+      return TRUE;
+    }
+  return FALSE;
+}
+
+/******************************************************************/
+
+void markTargets(Peephole* peephole) {
+  CodeBlock* codeBlock = peephole->codeBlock;
+  int i;
+
+  memset(peephole->target, 0, codeBlock->codeSize);
+  peephole->target[codeBlock->entry] = TRUE;
+  for (i = 0; i < codeBlock->codeSize; i ++)
+    if (operandsOf(codeBlock->code[i].op) & OPERAND_TARGET)
+      peephole->target[codeBlock->code[i].q] = TRUE;
+  // Procedures stay in the table even if nothing calls them
+  for (i = 0; i < NUM_OF_PROCEDURES(codeBlock); i ++)
+    peephole->target[PROCEDURE_ENTRY(codeBlock, i)->codeAddress] = TRUE;
+}
+
+// Squeezes out the deleted instructions; FALSE if memory runs out
+int compact(Peephole* peephole) {
+  CodeBlock* codeBlock = peephole->codeBlock;
+  CodeAddress* map;
+  int i, n, lines;
+
+  // A deleted instruction maps to the next live one
+  map = (CodeAddress*) malloc((codeBlock->codeSize + 1) * sizeof(CodeAddress));
+  if (map == NULL) return FALSE;
+  n = 0;
+  for (i = 0; i < codeBlock->codeSize; i ++) {
+    map[i] = n;
+    if (!peephole->deleted[i]) n ++;
+  }
+  map[codeBlock->codeSize] = n;
+
+  for (i = 0; i < codeBlock->codeSize; i ++)
+    if (!peephole->deleted[i]) {
+      Instruction* inst = codeBlock->code + map[i];
+      *inst = codeBlock->code[i];
+      if (operandsOf(inst->op) & OPERAND_TARGET) inst->q = map[inst->q];
+    }
+  codeBlock->entry = map[codeBlock->entry];
+  for (i = 0; i < NUM_OF_PROCEDURES(codeBlock); i ++)
+    PROCEDURE_ENTRY(codeBlock, i)->codeAddress = map[PROCEDURE_ENTRY(codeBlock, i)->codeAddress];
+
+  // Lines whose code went away entirely give way to the next line
+  lines = 0;
+  for (i = 0; i < NUM_OF_LINES(codeBlock); i ++) {
+    LineEntry entry = *LINE_ENTRY(codeBlock, i);
+
+    entry.codeAddress = map[entry.codeAddress];
+    if (entry.codeAddress >= n) break;
+    if (lines > 0 && LINE_ENTRY(codeBlock, lines - 1)->codeAddress == entry.codeAddress)
+      lines --;
+    if (lines > 0 && LINE_ENTRY(codeBlock, lines - 1)->lineNo == entry.lineNo) continue;
+    *LINE_ENTRY(codeBlock, lines ++) = entry;
+  }
+  codeBlock->lines.size = lines * sizeof(LineEntry);
+
+  codeBlock->codeSize = n;
+  free(map);
+  return TRUE;
+}
+
+int peephole(CodeBlock* codeBlock) {
+  Peephole peephole;
+  PeepholeRule* rule;
+  int size = codeBlock->codeSize;
+  int changed, i;
+
+  peephole.codeBlock = codeBlock;
+  peephole.target = (char*) malloc(codeBlock->codeSize + 1);
+  peephole.deleted = (char*) malloc(codeBlock->codeSize + 1);
+  if (peephole.target == NULL || peephole.deleted == NULL) {
+    free(peephole.target);
+    free(peephole.deleted);
+    return -1;
+  }
+
+  do {
+    changed = FALSE;
+    markTargets(&peephole);
+    memset(peephole.deleted, 0, codeBlock->codeSize);
+
+    for (i = 0; i < codeBlock->codeSize; i ++)
+      for (rule = peepholeRules; rule->name != NULL && !peephole.deleted[i]; rule ++)
+	if (rule->enabled && rule->apply(&peephole, i)) {
+	  rule->hits ++;
+	  changed = TRUE;
+	}
+
+    if (!compact(&peephole)) {
+      changed = -1;
+      break;
+    }
+    peepholePasses ++;
+  } while (changed && peepholePasses < MAX_PASSES);
+
+  free(peephole.target);
+  free(peephole.deleted);
+  if (changed < 0) return -1;
+  peepholeRemoved += size - codeBlock->codeSize;
+  return size - codeBlock->codeSize;
+}
+
+void printPeepholeReport(void) {
+  PeepholeRule* rule;
+
+  printf("Peephole: %d instructions removed in %d passes\n", peepholeRemoved, peepholePasses);
+  for (rule = peepholeRules; rule->name != NULL; rule ++)
+    printf("  %-12s %6d  %s%s\n", rule->name, rule->hits, rule->description,
+	   rule->enabled ? "" : " (disabled)");
+}
@@ -0,0 +1,50 @@
+/*
+ * @copyright (c) 2008, Hedspi, Hanoi University of Technology
+ * @author Huu-Duc Nguyen
+ * @version 1.0
+ */
+
+#ifndef __PEEPHOLE_H__
+#define __PEEPHOLE_H__
+
+#include "instructions.h"
+
+/* Peephole optimization of a finished CodeBlock.
+ *
+ * In each pass every enabled rule is tried on every live instruction.
+ * Rules rewrite instructions in place and mark those no longer needed
+ * as deleted. Between passes the deleted instructions are squeezed out
+ * and all code addresses move along with the code: jump and call
+ * targets, the entry, and the procedure and line tables. Passes repeat
+ * until no rule applies.
+ */
+
+struct Peephole_ {
+  CodeBlock* codeBlock;
+  char* target;     // reached by a jump or a call, or an entry point
+  char* deleted;
+};
+
+typedef struct Peephole_ Peephole;
+
+struct PeepholeRule_ {
+  char* name;
+  char* description;
+  // Tries the rule on the live instruction at; TRUE if it changed the code
+  int (*apply)(Peephole* peephole, CodeAddress at);
+  int enabled;
+  int hits;
+};
+
+typedef struct PeepholeRule_ PeepholeRule;
+
+extern PeepholeRule peepholeRules[];
+
+// FALSE if there is no rule of that name
+int enablePeepholeRule(char* name, int enabled);
+
+// The number of instructions removed, or -1 if memory runs out
+int peephole(CodeBlock* codeBlock);
+void printPeepholeReport(void);
+
+#endif
@@ -5,26 +5,92 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include "reader.h"
 
-FILE *inputStream;
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
+
+#define READ_CHUNK_SIZE (1 << 16)
+
 int lineNo, colNo;
 int currentChar;
 
-int readChar(void) {
-  currentChar = getc(inputStream);
-  colNo ++;
-  if (currentChar == '\n') {
-    lineNo ++;
-    colNo = 0;
+unsigned char *readerCursor;
+unsigned char *readerLimit;
+
+unsigned char *sourceBuffer;
+size_t sourceSize;
+int sourceMapped;
+
+// Fallback for pipes and other streams that cannot be mapped
+int readWholeStream(FILE *f) {
+  size_t capacity = READ_CHUNK_SIZE;
+  size_t n;
+
+  sourceBuffer = (unsigned char*) malloc(capacity);
+  if (sourceBuffer == NULL) return IO_ERROR;
+  sourceSize = 0;
+
+  while ((n = fread(sourceBuffer + sourceSize, 1, capacity - sourceSize, f)) > 0) {
+    sourceSize += n;
+    if (sourceSize == capacity) {
+      unsigned char *buffer = (unsigned char*) realloc(sourceBuffer, capacity * 2);
+      if (buffer == NULL) {
+	free(sourceBuffer);
+	return IO_ERROR;
+      }
+      sourceBuffer = buffer;
+      capacity *= 2;
+    }
+  }
+
+  if (ferror(f)) {
+    free(sourceBuffer);
+    return IO_ERROR;
+  }
+  return IO_SUCCESS;
+}
+
+int loadSource(FILE *f) {
+#ifndef _WIN32
+  struct stat st;
+
+  if ((fstat(fileno(f), &st) == 0) && S_ISREG(st.st_mode)) {
+    sourceSize = st.st_size;
+    if (sourceSize == 0) {
+      sourceBuffer = NULL;
+      sourceMapped = 0;
+      return IO_SUCCESS;
+    }
+    sourceBuffer = (unsigned char*) mmap(NULL, sourceSize, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+    if (sourceBuffer != (unsigned char*) MAP_FAILED) {
+      madvise(sourceBuffer, sourceSize, MADV_SEQUENTIAL);
+      sourceMapped = 1;
+      return IO_SUCCESS;
+    }
   }
-  return currentChar;
+#endif
+  sourceMapped = 0;
+  return readWholeStream(f);
 }
 
 int openInputStream(char *fileName) {
-  inputStream = fopen(fileName, "rt");
-  if (inputStream == NULL)
+  FILE *f = fopen(fileName, "rb");
+  int result;
+
+  if (f == NULL)
+    return IO_ERROR;
+  result = loadSource(f);
+  fclose(f);
+  if (result == IO_ERROR)
     return IO_ERROR;
+
+  readerCursor = sourceBuffer;
+  readerLimit = sourceBuffer + sourceSize;
   lineNo = 1;
   colNo = 0;
   readChar();
@@ -32,6 +98,14 @@ int openInputStream(char *fileName) {
 }
 
 void closeInputStream() {
-  fclose(inputStream);
+#ifndef _WIN32
+  if (sourceMapped) {
+    munmap(sourceBuffer, sourceSize);
+    sourceBuffer = NULL;
+    return;
+  }
+#endif
+  free(sourceBuffer);
+  sourceBuffer = NULL;
 }
 
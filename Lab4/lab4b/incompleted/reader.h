@@ -7,10 +7,29 @@
 #ifndef __READER_H__
 #define __READER_H__
 
+#include <stdio.h>
+
 #define IO_ERROR 0
 #define IO_SUCCESS 1
 
-int readChar(void);
+extern int lineNo, colNo;
+extern int currentChar;
+
+// The whole source is held in memory (mapped, or read in one go for pipes),
+// so reading a character is just a pointer bump.
+extern unsigned char *readerCursor;
+extern unsigned char *readerLimit;
+
+static inline int readChar(void) {
+  currentChar = (readerCursor < readerLimit) ? *readerCursor++ : EOF;
+  colNo ++;
+  if (currentChar == '\n') {
+    lineNo ++;
+    colNo = 0;
+  }
+  return currentChar;
+}
+
 int openInputStream(char *fileName);
 void closeInputStream(void);
 
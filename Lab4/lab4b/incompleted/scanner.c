@@ -13,6 +13,7 @@
 #include "token.h"
 #include "error.h"
 #include "scanner.h"
+#include "intern.h"
 
 
 extern int lineNo;
@@ -21,8 +22,27 @@ extern int currentChar;
 
 extern CharCode charCodes[];
 
+// Tokens are handed out from a small ring owned by the scanner. The parser
+// never holds more than currentToken and lookAhead, so a slot is dead long
+// before it comes round again and no token is ever malloc'ed or freed.
+Token tokenRing[TOKEN_RING_SIZE];
+int tokenRingNext = 0;
+
 /***************************************************************/
 
+Token* makeToken(TokenType tokenType, int lineNo, int colNo) {
+  Token *token = &tokenRing[tokenRingNext];
+  tokenRingNext = (tokenRingNext + 1) % TOKEN_RING_SIZE;
+  token->tokenType = tokenType;
+  token->lineNo = lineNo;
+  token->colNo = colNo;
+  return token;
+}
+
+void releaseTokens(void) {
+  tokenRingNext = 0;
+}
+
 void skipBlank() {
   while ((currentChar != EOF) && (charCodes[currentChar] == CHAR_SPACE))
     readChar();
@@ -52,12 +72,12 @@ Token* readIdentKeyword(void) {
   Token *token = makeToken(TK_NONE, lineNo, colNo);
   int count = 1;
 
-  token->string[0] = toupper((char)currentChar);
+  token->string[0] = UPPER_CASE(currentChar);
   readChar();
 
   while ((currentChar != EOF) && 
 	 ((charCodes[currentChar] == CHAR_LETTER) || (charCodes[currentChar] == CHAR_DIGIT))) {
-    if (count <= MAX_IDENT_LEN) token->string[count++] = toupper((char)currentChar);
+    if (count <= MAX_IDENT_LEN) token->string[count++] = UPPER_CASE(currentChar);
     readChar();
   }
 
@@ -69,8 +89,10 @@ Token* readIdentKeyword(void) {
   token->string[count] = '\0';
   token->tokenType = checkKeyword(token->string);
 
-  if (token->tokenType == TK_NONE)
+  if (token->tokenType == TK_NONE) {
     token->tokenType = TK_IDENT;
+    token->ident = internString(token->string, count);
+  }
 
   return token;
 }
@@ -238,7 +260,8 @@ Token* getToken(void) {
 Token* getValidToken(void) {
   Token *token = getToken();
   while (token->tokenType == TK_NONE) {
-    free(token);
+    // Hand the discarded slot straight back
+    tokenRingNext = (tokenRingNext + TOKEN_RING_SIZE - 1) % TOKEN_RING_SIZE;
     token = getToken();
   }
   return token;
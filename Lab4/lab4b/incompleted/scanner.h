@@ -9,8 +9,12 @@
 
 #include "token.h"
 
+#define TOKEN_RING_SIZE 4
+
+Token* makeToken(TokenType tokenType, int lineNo, int colNo);
 Token* getToken(void);
 Token* getValidToken(void);
+void releaseTokens(void);
 void printToken(Token *token);
 
 #endif
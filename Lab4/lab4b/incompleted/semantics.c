@@ -18,17 +18,17 @@ Object* lookupObject(char *name) {
   Object* obj;
 
   while (scope != NULL) {
-    obj = findObject(scope->objList, name);
+    obj = findObject(scope, name);
     if (obj != NULL) return obj;
     scope = scope->outer;
   }
-  obj = findObject(symtab->globalObjectList, name);
+  obj = findObject(symtab->globalScope, name);
   if (obj != NULL) return obj;
   return NULL;
 }
 
 void checkFreshIdent(char *name) {
-  if (findObject(symtab->currentScope->objList, name) != NULL)
+  if (findObject(symtab->currentScope, name) != NULL)
     error(ERR_DUPLICATE_IDENT, currentToken->lineNo, currentToken->colNo);
 }
 
@@ -123,6 +123,11 @@ void checkIntType(Type* type) {
   else error(ERR_TYPE_INCONSISTENCY, currentToken->lineNo, currentToken->colNo);
 }
 
+void checkIntConstant(ConstantValue* value) {
+  if (value->type != TP_INT)
+    error(ERR_TYPE_INCONSISTENCY, currentToken->lineNo, currentToken->colNo);
+}
+
 void checkCharType(Type* type) {
   if ((type != NULL) && (type->typeClass == TP_CHAR))
     return;
@@ -23,5 +23,6 @@ void checkCharType(Type* type);
 void checkArrayType(Type* type);
 void checkBasicType(Type* type);
 void checkTypeEquality(Type* type1, Type* type2);
+void checkIntConstant(ConstantValue* value);
 
 #endif
@@ -10,15 +10,22 @@
 #include "symtab.h"
 #include "error.h"
 #include "codegen.h"
+#include "intern.h"
+#include "arena.h"
 
-void freeObject(Object* obj);
-void freeScope(Scope* scope);
-void freeObjectList(ObjectNode *objList);
-void freeReferenceList(ObjectNode *objList);
+#define INITIAL_INDEX_SIZE 8
+#define INITIAL_TYPE_TABLE_SIZE 16
+#define HASH_NAME(name) ((unsigned) (((size_t) (name) >> 3) * 2654435761u))
+#define HASH_ARRAY_TYPE(arraySize, elementType) (HASH_NAME(elementType) ^ ((unsigned) (arraySize) * 40503u))
 
+// Everything the symbol table allocates lives until cleanSymTab()
+Arena* symtabArena;
 SymTab* symtab;
 Type* intType;
 Type* charType;
+Type** arrayTypeTable;
+int arrayTypeTableSize;
+int arrayTypeCount;
 Object* writeiProcedure;
 Object* writecProcedure;
 Object* writelnProcedure;
@@ -27,89 +34,101 @@ Object* readcFunction;
 
 /******************* Type utilities ******************************/
 
-Type* makeIntType(void) {
-  Type* type = (Type*) malloc(sizeof(Type));
-  type->typeClass = TP_INT;
+Type* makeBasicType(enum TypeClass typeClass, int size) {
+  Type* type = (Type*) arenaAlloc(symtabArena, sizeof(Type));
+  type->typeClass = typeClass;
+  type->arraySize = 0;
+  type->elementType = NULL;
+  type->size = size;
+  type->nextArrayType = NULL;
   return type;
 }
 
+Type* makeIntType(void) {
+  return intType;
+}
+
 Type* makeCharType(void) {
-  Type* type = (Type*) malloc(sizeof(Type));
-  type->typeClass = TP_CHAR;
-  return type;
+  return charType;
+}
+
+void growArrayTypeTable(void) {
+  int size = (arrayTypeTableSize == 0) ? INITIAL_TYPE_TABLE_SIZE : arrayTypeTableSize * 2;
+  Type** table = (Type**) arenaAlloc(symtabArena, size * sizeof(Type*));
+  Type* type;
+  int i, h;
+
+  memset(table, 0, size * sizeof(Type*));
+  for (i = 0; i < arrayTypeTableSize; i++) {
+    while ((type = arrayTypeTable[i]) != NULL) {
+      arrayTypeTable[i] = type->nextArrayType;
+      h = HASH_ARRAY_TYPE(type->arraySize, type->elementType) & (size - 1);
+      type->nextArrayType = table[h];
+      table[h] = type;
+    }
+  }
+  arrayTypeTable = table;
+  arrayTypeTableSize = size;
 }
 
 Type* makeArrayType(int arraySize, Type* elementType) {
-  Type* type = (Type*) malloc(sizeof(Type));
+  Type* type;
+  int h;
+
+  if (arrayTypeTableSize > 0) {
+    h = HASH_ARRAY_TYPE(arraySize, elementType) & (arrayTypeTableSize - 1);
+    for (type = arrayTypeTable[h]; type != NULL; type = type->nextArrayType)
+      if ((type->arraySize == arraySize) && (type->elementType == elementType))
+	return type;
+  }
+
+  if (arrayTypeCount >= arrayTypeTableSize)
+    growArrayTypeTable();
+
+  type = (Type*) arenaAlloc(symtabArena, sizeof(Type));
   type->typeClass = TP_ARRAY;
   type->arraySize = arraySize;
   type->elementType = elementType;
+  type->size = arraySize * elementType->size;
+
+  h = HASH_ARRAY_TYPE(arraySize, elementType) & (arrayTypeTableSize - 1);
+  type->nextArrayType = arrayTypeTable[h];
+  arrayTypeTable[h] = type;
+  arrayTypeCount ++;
   return type;
 }
 
+// Types are canonical, so a typed name can share its type node
 Type* duplicateType(Type* type) {
-  Type* resultType = (Type*) malloc(sizeof(Type));
-  resultType->typeClass = type->typeClass;
-  if (type->typeClass == TP_ARRAY) {
-    resultType->arraySize = type->arraySize;
-    resultType->elementType = duplicateType(type->elementType);
-  }
-  return resultType;
+  return type;
 }
 
 int compareType(Type* type1, Type* type2) {
-  if (type1->typeClass == type2->typeClass) {
-    if (type1->typeClass == TP_ARRAY) {
-      if (type1->arraySize == type2->arraySize)
-	return compareType(type1->elementType, type2->elementType);
-      else return 0;
-    } else return 1;
-  } else return 0;
-}
-
-void freeType(Type* type) {
-  switch (type->typeClass) {
-  case TP_INT:
-  case TP_CHAR:
-    free(type);
-    break;
-  case TP_ARRAY:
-    freeType(type->elementType);
-    freeType(type);
-    break;
-  }
+  return (type1 == type2);
 }
 
 int sizeOfType(Type* type) {
-  switch (type->typeClass) {
-  case TP_INT:
-    return INT_SIZE;
-  case TP_CHAR:
-    return CHAR_SIZE;
-  case TP_ARRAY:
-    return (type->arraySize * sizeOfType(type->elementType));
-  }
-  return 0;
+  return type->size;
 }
 
 /******************* Constant utility ******************************/
 
 ConstantValue* makeIntConstant(int i) {
-  ConstantValue* value = (ConstantValue*) malloc(sizeof(ConstantValue));
+  ConstantValue* value = (ConstantValue*) arenaAlloc(symtabArena, sizeof(ConstantValue));
   value->type = TP_INT;
   value->intValue = i;
   return value;
 }
 
 ConstantValue* makeCharConstant(char ch) {
-  ConstantValue* value = (ConstantValue*) malloc(sizeof(ConstantValue));
+  ConstantValue* value = (ConstantValue*) arenaAlloc(symtabArena, sizeof(ConstantValue));
   value->type = TP_CHAR;
   value->charValue = ch;
   return value;
 }
 
 ConstantValue* duplicateConstantValue(ConstantValue* v) {
-  ConstantValue* value = (ConstantValue*) malloc(sizeof(ConstantValue));
+  ConstantValue* value = (ConstantValue*) arenaAlloc(symtabArena, sizeof(ConstantValue));
   value->type = v->type;
   if (v->type == TP_INT) 
     value->intValue = v->intValue;
@@ -121,8 +140,12 @@ ConstantValue* duplicateConstantValue(ConstantValue* v) {
 /******************* Object utilities ******************************/
 
 Scope* createScope(Object* owner) {
-  Scope* scope = (Scope*) malloc(sizeof(Scope));
+  Scope* scope = (Scope*) arenaAlloc(symtabArena, sizeof(Scope));
   scope->objList = NULL;
+  scope->lastNode = NULL;
+  scope->index = NULL;
+  scope->indexSize = 0;
+  scope->objCount = 0;
   scope->owner = owner;
   scope->outer = NULL;
   scope->frameSize = RESERVED_WORDS;
@@ -130,10 +153,10 @@ Scope* createScope(Object* owner) {
 }
 
 Object* createProgramObject(char *programName) {
-  Object* program = (Object*) malloc(sizeof(Object));
-  strcpy(program->name, programName);
+  Object* program = (Object*) arenaAlloc(symtabArena, sizeof(Object));
+  program->name = programName;
   program->kind = OBJ_PROGRAM;
-  program->progAttrs = (ProgramAttributes*) malloc(sizeof(ProgramAttributes));
+  program->progAttrs = (ProgramAttributes*) arenaAlloc(symtabArena, sizeof(ProgramAttributes));
   program->progAttrs->scope = createScope(program);
   program->progAttrs->codeAddress = DC_VALUE;
   symtab->program = program;
@@ -142,26 +165,26 @@ Object* createProgramObject(char *programName) {
 }
 
 Object* createConstantObject(char *name) {
-  Object* obj = (Object*) malloc(sizeof(Object));
-  strcpy(obj->name, name);
+  Object* obj = (Object*) arenaAlloc(symtabArena, sizeof(Object));
+  obj->name = name;
   obj->kind = OBJ_CONSTANT;
-  obj->constAttrs = (ConstantAttributes*) malloc(sizeof(ConstantAttributes));
+  obj->constAttrs = (ConstantAttributes*) arenaAlloc(symtabArena, sizeof(ConstantAttributes));
   return obj;
 }
 
 Object* createTypeObject(char *name) {
-  Object* obj = (Object*) malloc(sizeof(Object));
-  strcpy(obj->name, name);
+  Object* obj = (Object*) arenaAlloc(symtabArena, sizeof(Object));
+  obj->name = name;
   obj->kind = OBJ_TYPE;
-  obj->typeAttrs = (TypeAttributes*) malloc(sizeof(TypeAttributes));
+  obj->typeAttrs = (TypeAttributes*) arenaAlloc(symtabArena, sizeof(TypeAttributes));
   return obj;
 }
 
 Object* createVariableObject(char *name) {
-  Object* obj = (Object*) malloc(sizeof(Object));
-  strcpy(obj->name, name);
+  Object* obj = (Object*) arenaAlloc(symtabArena, sizeof(Object));
+  obj->name = name;
   obj->kind = OBJ_VARIABLE;
-  obj->varAttrs = (VariableAttributes*) malloc(sizeof(VariableAttributes));
+  obj->varAttrs = (VariableAttributes*) arenaAlloc(symtabArena, sizeof(VariableAttributes));
   obj->varAttrs->type = NULL;
   obj->varAttrs->scope = NULL;
   obj->varAttrs->localOffset = 0;
@@ -169,10 +192,10 @@ Object* createVariableObject(char *name) {
 }
 
 Object* createFunctionObject(char *name) {
-  Object* obj = (Object*) malloc(sizeof(Object));
-  strcpy(obj->name, name);
+  Object* obj = (Object*) arenaAlloc(symtabArena, sizeof(Object));
+  obj->name = name;
   obj->kind = OBJ_FUNCTION;
-  obj->funcAttrs = (FunctionAttributes*) malloc(sizeof(FunctionAttributes));
+  obj->funcAttrs = (FunctionAttributes*) arenaAlloc(symtabArena, sizeof(FunctionAttributes));
   obj->funcAttrs->returnType = NULL;
   obj->funcAttrs->paramList = NULL;
   obj->funcAttrs->paramCount = 0;
@@ -182,10 +205,10 @@ Object* createFunctionObject(char *name) {
 }
 
 Object* createProcedureObject(char *name) {
-  Object* obj = (Object*) malloc(sizeof(Object));
-  strcpy(obj->name, name);
+  Object* obj = (Object*) arenaAlloc(symtabArena, sizeof(Object));
+  obj->name = name;
   obj->kind = OBJ_PROCEDURE;
-  obj->procAttrs = (ProcedureAttributes*) malloc(sizeof(ProcedureAttributes));
+  obj->procAttrs = (ProcedureAttributes*) arenaAlloc(symtabArena, sizeof(ProcedureAttributes));
   obj->procAttrs->paramList = NULL;
   obj->procAttrs->paramCount = 0;
   obj->procAttrs->codeAddress = DC_VALUE;
@@ -194,10 +217,10 @@ Object* createProcedureObject(char *name) {
 }
 
 Object* createParameterObject(char *name, enum ParamKind kind) {
-  Object* obj = (Object*) malloc(sizeof(Object));
-  strcpy(obj->name, name);
+  Object* obj = (Object*) arenaAlloc(symtabArena, sizeof(Object));
+  obj->name = name;
   obj->kind = OBJ_PARAMETER;
-  obj->paramAttrs = (ParameterAttributes*) malloc(sizeof(ParameterAttributes));
+  obj->paramAttrs = (ParameterAttributes*) arenaAlloc(symtabArena, sizeof(ParameterAttributes));
   obj->paramAttrs->kind = kind;
   obj->paramAttrs->type = NULL;
   obj->paramAttrs->scope = NULL;
@@ -205,70 +228,8 @@ Object* createParameterObject(char *name, enum ParamKind kind) {
   return obj;
 }
 
-void freeObject(Object* obj) {
-  switch (obj->kind) {
-  case OBJ_CONSTANT:
-    free(obj->constAttrs->value);
-    free(obj->constAttrs);
-    break;
-  case OBJ_TYPE:
-    free(obj->typeAttrs->actualType);
-    free(obj->typeAttrs);
-    break;
-  case OBJ_VARIABLE:
-    free(obj->varAttrs->type);
-    free(obj->varAttrs);
-    break;
-  case OBJ_FUNCTION:
-    freeReferenceList(obj->funcAttrs->paramList);
-    freeType(obj->funcAttrs->returnType);
-    freeScope(obj->funcAttrs->scope);
-    free(obj->funcAttrs);
-    break;
-  case OBJ_PROCEDURE:
-    freeReferenceList(obj->procAttrs->paramList);
-    freeScope(obj->procAttrs->scope);
-    free(obj->procAttrs);
-    break;
-  case OBJ_PROGRAM:
-    freeScope(obj->progAttrs->scope);
-    free(obj->progAttrs);
-    break;
-  case OBJ_PARAMETER:
-    freeType(obj->paramAttrs->type);
-    free(obj->paramAttrs);
-  }
-  free(obj);
-}
-
-void freeScope(Scope* scope) {
-  freeObjectList(scope->objList);
-  free(scope);
-}
-
-void freeObjectList(ObjectNode *objList) {
-  ObjectNode* list = objList;
-
-  while (list != NULL) {
-    ObjectNode* node = list;
-    list = list->next;
-    freeObject(node->object);
-    free(node);
-  }
-}
-
-void freeReferenceList(ObjectNode *objList) {
-  ObjectNode* list = objList;
-
-  while (list != NULL) {
-    ObjectNode* node = list;
-    list = list->next;
-    free(node);
-  }
-}
-
 void addObject(ObjectNode **objList, Object* obj) {
-  ObjectNode* node = (ObjectNode*) malloc(sizeof(ObjectNode));
+  ObjectNode* node = (ObjectNode*) arenaAlloc(symtabArena, sizeof(ObjectNode));
   node->object = obj;
   node->next = NULL;
   if ((*objList) == NULL) 
@@ -281,11 +242,51 @@ void addObject(ObjectNode **objList, Object* obj) {
   }
 }
 
-Object* findObject(ObjectNode *objList, char *name) {
-  while (objList != NULL) {
-    if (strcmp(objList->object->name, name) == 0) 
-      return objList->object;
-    else objList = objList->next;
+void insertIndex(Object **index, int size, Object* obj) {
+  int i = HASH_NAME(obj->name) & (size - 1);
+  while (index[i] != NULL)
+    i = (i + 1) & (size - 1);
+  index[i] = obj;
+}
+
+void growIndex(Scope* scope) {
+  int size = (scope->indexSize == 0) ? INITIAL_INDEX_SIZE : scope->indexSize * 2;
+  Object **index = (Object**) arenaAlloc(symtabArena, size * sizeof(Object*));
+  int i;
+
+  memset(index, 0, size * sizeof(Object*));
+  for (i = 0; i < scope->indexSize; i++)
+    if (scope->index[i] != NULL)
+      insertIndex(index, size, scope->index[i]);
+  scope->index = index;
+  scope->indexSize = size;
+}
+
+void addScopeObject(Scope* scope, Object* obj) {
+  ObjectNode* node = (ObjectNode*) arenaAlloc(symtabArena, sizeof(ObjectNode));
+  node->object = obj;
+  node->next = NULL;
+  if (scope->lastNode == NULL)
+    scope->objList = node;
+  else scope->lastNode->next = node;
+  scope->lastNode = node;
+
+  // Keep the index at most half full
+  if (2 * (scope->objCount + 1) > scope->indexSize)
+    growIndex(scope);
+  insertIndex(scope->index, scope->indexSize, obj);
+  scope->objCount ++;
+}
+
+Object* findObject(Scope* scope, char *name) {
+  int i;
+
+  if (scope->indexSize == 0) return NULL;
+  i = HASH_NAME(name) & (scope->indexSize - 1);
+  while (scope->index[i] != NULL) {
+    if (scope->index[i]->name == name)
+      return scope->index[i];
+    i = (i + 1) & (scope->indexSize - 1);
   }
   return NULL;
 }
@@ -295,49 +296,52 @@ Object* findObject(ObjectNode *objList, char *name) {
 void initSymTab(void) {
   Object* param;
 
-  symtab = (SymTab*) malloc(sizeof(SymTab));
-  symtab->globalObjectList = NULL;
+  symtabArena = createArena();
+  symtab = (SymTab*) arenaAlloc(symtabArena, sizeof(SymTab));
+
+  intType = makeBasicType(TP_INT, INT_SIZE);
+  charType = makeBasicType(TP_CHAR, CHAR_SIZE);
+  arrayTypeTable = NULL;
+  arrayTypeTableSize = 0;
+  arrayTypeCount = 0;
+
+  symtab->globalScope = createScope(NULL);
   symtab->program = NULL;
   symtab->currentScope = NULL;
   
-  readcFunction = createFunctionObject("READC");
+  readcFunction = createFunctionObject(internString("READC", 5));
   declareObject(readcFunction);
   readcFunction->funcAttrs->returnType = makeCharType();
 
-  readiFunction = createFunctionObject("READI");
+  readiFunction = createFunctionObject(internString("READI", 5));
   declareObject(readiFunction);
   readiFunction->funcAttrs->returnType = makeIntType();
 
 
-  writeiProcedure = createProcedureObject("WRITEI");
+  writeiProcedure = createProcedureObject(internString("WRITEI", 6));
   declareObject(writeiProcedure);
   enterBlock(writeiProcedure->procAttrs->scope);
-    param = createParameterObject("i", PARAM_VALUE);
+    param = createParameterObject(internString("i", 1), PARAM_VALUE);
     param->paramAttrs->type = makeIntType();
     declareObject(param);
   exitBlock();
 
-  writecProcedure = createProcedureObject("WRITEC");
+  writecProcedure = createProcedureObject(internString("WRITEC", 6));
   declareObject(writecProcedure);
   enterBlock(writecProcedure->procAttrs->scope);
-    param = createParameterObject("ch", PARAM_VALUE);
+    param = createParameterObject(internString("ch", 2), PARAM_VALUE);
     param->paramAttrs->type = makeCharType();
     declareObject(param);
   exitBlock();
 
-  writelnProcedure = createProcedureObject("WRITELN");
+  writelnProcedure = createProcedureObject(internString("WRITELN", 7));
   declareObject(writelnProcedure);
-
-  intType = makeIntType();
-  charType = makeCharType();
 }
 
 void cleanSymTab(void) {
-  freeObject(symtab->program);
-  freeObjectList(symtab->globalObjectList);
-  free(symtab);
-  freeType(intType);
-  freeType(charType);
+  freeArena(symtabArena);
+  symtabArena = NULL;
+  symtab = NULL;
 }
 
 void enterBlock(Scope* scope) {
@@ -352,7 +356,7 @@ void declareObject(Object* obj) {
   Object* owner;
 
   if (symtab->currentScope == NULL)  //  globalObject
-    addObject(&(symtab->globalObjectList), obj);
+    addScopeObject(symtab->globalScope, obj);
   else {
     switch (obj->kind) {
     case OBJ_VARIABLE:
@@ -386,7 +390,7 @@ void declareObject(Object* obj) {
       break;
     default: break;
     }
-    addObject(&(symtab->currentScope->objList), obj);
+    addScopeObject(symtab->currentScope, obj);
   }
   
 }
@@ -31,10 +31,15 @@ enum ParamKind {
   PARAM_REFERENCE
 };
 
+// Types are hash-consed: there is exactly one Type node for each distinct
+// type, so two types are equal iff their pointers are equal. Type nodes
+// are shared and must never be modified once made.
 struct Type_ {
   enum TypeClass typeClass;
   int arraySize;
   struct Type_ *elementType;
+  int size;                    // cached sizeOfType
+  struct Type_ *nextArrayType; // chain in the array type table
 };
 
 typedef struct Type_ Type;
@@ -109,7 +114,7 @@ typedef struct ProgramAttributes_ ProgramAttributes;
 typedef struct ParameterAttributes_ ParameterAttributes;
 
 struct Object_ {
-  char name[MAX_IDENT_LEN];
+  char *name;             // interned, see intern.h
   enum ObjectKind kind;
   union {
     ConstantAttributes* constAttrs;
@@ -132,7 +137,11 @@ struct ObjectNode_ {
 typedef struct ObjectNode_ ObjectNode;
 
 struct Scope_ {
-  ObjectNode *objList;
+  ObjectNode *objList;    // objects in declaration order
+  ObjectNode *lastNode;   // tail of objList
+  Object **index;         // open-addressing table keyed by the interned name
+  int indexSize;
+  int objCount;
   Object *owner;
   struct Scope_ *outer;
   int frameSize;
@@ -143,7 +152,7 @@ typedef struct Scope_ Scope;
 struct SymTab_ {
   Object* program;
   Scope* currentScope;
-  ObjectNode *globalObjectList;
+  Scope* globalScope;
 };
 
 typedef struct SymTab_ SymTab;
@@ -153,7 +162,6 @@ Type* makeCharType(void);
 Type* makeArrayType(int arraySize, Type* elementType);
 Type* duplicateType(Type* type);
 int compareType(Type* type1, Type* type2);
-void freeType(Type* type);
 int sizeOfType(Type* type);
 
 ConstantValue* makeIntConstant(int i);
@@ -162,6 +170,9 @@ ConstantValue* duplicateConstantValue(ConstantValue* v);
 
 Scope* createScope(Object* owner);
 
+// Object names must be interned with internString(); findObject compares
+// names by pointer.
+
 Object* createProgramObject(char *programName);
 Object* createConstantObject(char *name);
 Object* createTypeObject(char *name);
@@ -170,7 +181,7 @@ Object* createFunctionObject(char *name);
 Object* createProcedureObject(char *name);
 Object* createParameterObject(char *name, enum ParamKind kind);
 
-Object* findObject(ObjectNode *objList, char *name);
+Object* findObject(Scope* scope, char *name);
 
 void initSymTab(void);
 void cleanSymTab(void);
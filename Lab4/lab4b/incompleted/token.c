@@ -6,6 +6,7 @@
 
 #include <stdlib.h>
 #include <ctype.h>
+#include <string.h>
 #include "token.h"
 
 struct {
@@ -34,9 +35,31 @@ struct {
   {"TO", KW_TO}
 };
 
+/* Keywords are found with a perfect hash on the length and the first two
+ * letters. The hash ignores case, and no two keywords share a slot, so an
+ * identifier costs one probe and at most one string compare. */
+#define KEYWORD_TABLE_SIZE 64
+#define KEYWORD_FOLD(ch) ((ch) & 0xDF)
+#define KEYWORD_HASH(len, s) \
+  (((len) + 2 * KEYWORD_FOLD((s)[0]) + 4 * KEYWORD_FOLD((s)[1])) & (KEYWORD_TABLE_SIZE - 1))
+
+int keywordTable[KEYWORD_TABLE_SIZE];
+int keywordTableReady = 0;
+
+void buildKeywordTable(void) {
+  int i, h;
+  for (h = 0; h < KEYWORD_TABLE_SIZE; h++)
+    keywordTable[h] = -1;
+  for (i = 0; i < KEYWORDS_COUNT; i++) {
+    h = KEYWORD_HASH(strlen(keywords[i].string), keywords[i].string);
+    keywordTable[h] = i;
+  }
+  keywordTableReady = 1;
+}
+
 int keywordEq(char *kw, char *string) {
   while ((*kw != '\0') && (*string != '\0')) {
-    if (*kw != *string) break;
+    if (*kw != KEYWORD_FOLD(*string)) break;
     kw ++; string ++;
   }
   return ((*kw == '\0') && (*string == '\0'));
@@ -44,18 +67,12 @@ int keywordEq(char *kw, char *string) {
 
 TokenType checkKeyword(char *string) {
   int i;
-  for (i = 0; i < KEYWORDS_COUNT; i++)
-    if (keywordEq(keywords[i].string, string)) 
-      return keywords[i].tokenType;
-  return TK_NONE;
-}
 
-Token* makeToken(TokenType tokenType, int lineNo, int colNo) {
-  Token *token = (Token*)malloc(sizeof(Token));
-  token->tokenType = tokenType;
-  token->lineNo = lineNo;
-  token->colNo = colNo;
-  return token;
+  if (!keywordTableReady) buildKeywordTable();
+  i = keywordTable[KEYWORD_HASH(strlen(string), string)];
+  if ((i >= 0) && keywordEq(keywords[i].string, string))
+    return keywords[i].tokenType;
+  return TK_NONE;
 }
 
 char *tokenToString(TokenType tokenType) {
@@ -0,0 +1,227 @@
+/*
+ * @copyright (c) 2008, Hedspi, Hanoi University of Technology
+ * @author Huu-Duc Nguyen
+ * @version 1.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "vm.h"
+
+/* The interpreter dispatches through a table of label addresses (GCC
+ * computed gotos), so that every instruction ends with its own indirect
+ * jump. Compilers without the extension, or builds with
+ * -DVM_SWITCH_DISPATCH, get a plain switch in a loop instead.
+ */
+#if !defined(__GNUC__) && !defined(VM_SWITCH_DISPATCH)
+#define VM_SWITCH_DISPATCH
+#endif
+
+#define MIN_STACK_SIZE 16
+
+VM* createVM(int stackSize) {
+  VM* vm = (VM*) malloc(sizeof(VM));
+
+  if (vm == NULL) return NULL;
+  if (stackSize < MIN_STACK_SIZE) stackSize = MIN_STACK_SIZE;
+  vm->stack = (WORD*) malloc((stackSize + 1) * sizeof(WORD));
+  if (vm->stack == NULL) {
+    free(vm);
+    return NULL;
+  }
+  vm->stack ++;
+  vm->stackSize = stackSize;
+  vm->input = stdin;
+  vm->output = stdout;
+  vm->pc = 0;
+  vm->t = -1;
+  vm->b = 0;
+  vm->dispatches = 0;
+  return vm;
+}
+
+void freeVM(VM* vm) {
+  free(vm->stack - 1);
+  free(vm);
+}
+
+int checkCode(CodeBlock* codeBlock) {
+  int i;
+
+  if (codeBlock->codeSize == 0) return FALSE;
+  if (codeBlock->entry < 0 || codeBlock->entry >= codeBlock->codeSize) return FALSE;
+
+  for (i = 0; i < codeBlock->codeSize; i ++) {
+    Instruction* inst = codeBlock->code + i;
+
+    if ((unsigned) inst->op > OP_BP) return FALSE;
+    // Shift counts the executors can use as they are
+    if (inst->op == OP_SHL && (unsigned) inst->q > 31) return FALSE;
+    if (inst->op == OP_DVM && (unsigned) inst->p > 31) return FALSE;
+    if (inst->op == OP_SHR && (inst->q < 1 || inst->q > 31)) return FALSE;
+    // Display levels index the executors' display as they are
+    if ((inst->op == OP_LAD || inst->op == OP_LVD || inst->op == OP_DSP || inst->op == OP_DRS) &&
+	(unsigned) inst->p >= DISPLAY_SIZE)
+      return FALSE;
+    if ((operandsOf(inst->op) & OPERAND_TARGET) &&
+	(inst->q < 0 || inst->q >= codeBlock->codeSize))
+      return FALSE;
+  }
+
+  // Execution must not run off the end of the code
+  switch (codeBlock->code[codeBlock->codeSize - 1].op) {
+  case OP_HL: case OP_J: case OP_EP: case OP_EF: return TRUE;
+  default: return FALSE;
+  }
+}
+
+char* vmStatusMessage(enum VMStatus status) {
+  switch (status) {
+  case VM_HALTED: return "Halted.";
+  case VM_BAD_CODE: return "Invalid code.";
+  case VM_STACK_OVERFLOW: return "Stack overflow.";
+  case VM_BAD_ADDRESS: return "Invalid memory access.";
+  case VM_DIVISION_BY_ZERO: return "Division by zero.";
+  case VM_BAD_INPUT: return "Invalid input.";
+  }
+  return "Unknown error.";
+}
+
+char* vmDispatchMethod(void) {
+#ifdef VM_SWITCH_DISPATCH
+  return "switch";
+#else
+  return "computed goto";
+#endif
+}
+
+/******************************************************************/
+
+// Handlers only the threaded form uses, for operands known at translation
+#define XOP_LA_LOCAL (OP_BP + 1)   // LA 0,q
+#define XOP_LV_LOCAL (OP_BP + 2)   // LV 0,q
+#define NUM_OF_HANDLERS (OP_BP + 3)
+
+// Stack checks; the code itself was checked by checkCode
+#define NEED(n) do { if (t < (n) - 1) goto badAddress; } while (0)
+#define ROOM(n) do { if (t >= stackSize - (n)) goto stackOverflow; } while (0)
+#define CHECK_ADDRESS(a) do { if ((unsigned) (a) >= (unsigned) stackSize) goto badAddress; } while (0)
+#define CHECK_RETURN(a) do { if ((unsigned) (a) >= (unsigned) codeSize) goto badAddress; } while (0)
+
+// Follows p static links from the current frame
+#define BASE(p, result) do { int level_ = (p); result = b;		\
+    while (level_ -- > 0) { CHECK_ADDRESS(result + 3); result = s[result + 3]; } } while (0)
+
+// Arithmetic wraps around instead of overflowing
+#define ADD(x, y) ((WORD) ((unsigned) (x) + (unsigned) (y)))
+#define SUB(x, y) ((WORD) ((unsigned) (x) - (unsigned) (y)))
+#define MUL(x, y) ((WORD) ((unsigned) (x) * (unsigned) (y)))
+#define NEGATE(x) ((WORD) (0u - (unsigned) (x)))
+#define DIV(x, y) (((y) == -1) ? NEGATE(x) : (x) / (y))
+// Division by 2^k and by a magic number, rounding toward zero like DIV
+#define SHIFT_LEFT(x, k) ((WORD) ((unsigned) (x) << (k)))
+#define SHIFT_RIGHT(x, k) (((x) + (WORD) ((unsigned) ((x) >> 31) >> (32 - (k)))) >> (k))
+#define MAGIC_DIVIDE(x, magic, shift)					\
+  ((((WORD) (((long long) (x) * (magic)) >> 32) + ((magic) < 0 ? (x) : 0)) >> (shift)) \
+   + (WORD) ((unsigned) (x) >> 31))
+#define EQ(x, y) ((x) == (y))
+#define NE(x, y) ((x) != (y))
+#define GT(x, y) ((x) > (y))
+#define LT(x, y) ((x) < (y))
+#define GE(x, y) ((x) >= (y))
+#define LE(x, y) ((x) <= (y))
+
+void** threadedHandlers;
+void** cachedHandlers;
+
+#define EXEC_NAME runPlainCode
+#include "vmexec.h"
+#undef EXEC_NAME
+
+#define EXEC_THREADED
+
+#define EXEC_NAME runThreadedCode
+#define EXEC_HANDLERS threadedHandlers
+#include "vmexec.h"
+#undef EXEC_HANDLERS
+#undef EXEC_NAME
+
+#define EXEC_CACHED
+#define EXEC_NAME runCachedCode
+#define EXEC_HANDLERS cachedHandlers
+#include "vmexec.h"
+#undef EXEC_HANDLERS
+#undef EXEC_NAME
+#undef EXEC_CACHED
+
+#undef EXEC_THREADED
+
+/* Translates code into direct-threaded form: handler addresses are looked
+ * up, jump and call targets become pointers, and loads and address
+ * computations in the current frame get handlers that skip the static
+ * link walk. Return addresses on the stack stay instruction indices,
+ * which the translation keeps. Operands are left as they are: p and q
+ * are word offsets into s, which s[b + q] scales in its addressing mode
+ * for free, so byte offsets would save nothing. */
+ThreadedCode* translateCode(CodeBlock* codeBlock, int cacheTop) {
+  ThreadedCode* threadedCode;
+  int i;
+#ifndef VM_SWITCH_DISPATCH
+  void** handlers;
+#endif
+
+  if (!checkCode(codeBlock)) return NULL;
+#ifndef VM_SWITCH_DISPATCH
+  if (threadedHandlers == NULL) {
+    runThreadedCode(NULL, NULL);
+    runCachedCode(NULL, NULL);
+  }
+  handlers = cacheTop ? cachedHandlers : threadedHandlers;
+#endif
+
+  threadedCode = (ThreadedCode*) malloc(sizeof(ThreadedCode));
+  if (threadedCode == NULL) return NULL;
+  threadedCode->code = (ThreadedInstruction*) malloc(codeBlock->codeSize * sizeof(ThreadedInstruction));
+  if (threadedCode->code == NULL) {
+    free(threadedCode);
+    return NULL;
+  }
+  threadedCode->codeSize = codeBlock->codeSize;
+  threadedCode->entry = codeBlock->entry;
+  threadedCode->cacheTop = cacheTop;
+
+  for (i = 0; i < codeBlock->codeSize; i ++) {
+    Instruction* inst = codeBlock->code + i;
+    ThreadedInstruction* threaded = threadedCode->code + i;
+    int op = inst->op;
+
+    if (op == OP_LA && inst->p == 0) op = XOP_LA_LOCAL;
+    else if (op == OP_LV && inst->p == 0) op = XOP_LV_LOCAL;
+
+#ifdef VM_SWITCH_DISPATCH
+    threaded->op = op;
+#else
+    threaded->handler = handlers[op];
+#endif
+    threaded->p = inst->p;
+    threaded->q = inst->q;
+    threaded->target = (operandsOf(inst->op) & OPERAND_TARGET) ? threadedCode->code + inst->q : NULL;
+  }
+  return threadedCode;
+}
+
+void freeThreadedCode(ThreadedCode* threadedCode) {
+  free(threadedCode->code);
+  free(threadedCode);
+}
+
+enum VMStatus runCode(VM* vm, CodeBlock* codeBlock) {
+  if (!checkCode(codeBlock)) return VM_BAD_CODE;
+  return runPlainCode(vm, codeBlock);
+}
+
+enum VMStatus runThreaded(VM* vm, ThreadedCode* threadedCode) {
+  if (threadedCode->cacheTop) 
+    return runCachedCode(vm, threadedCode);
+  return runThreadedCode(vm, threadedCode);
+}
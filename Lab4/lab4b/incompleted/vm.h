@@ -0,0 +1,78 @@
+/*
+ * @copyright (c) 2008, Hedspi, Hanoi University of Technology
+ * @author Huu-Duc Nguyen
+ * @version 1.0
+ */
+
+#ifndef __VM_H__
+#define __VM_H__
+
+#include <stdio.h>
+#include "instructions.h"
+
+#define DEFAULT_STACK_SIZE (1 << 20)
+
+enum VMStatus {
+  VM_HALTED,
+  VM_BAD_CODE,
+  VM_STACK_OVERFLOW,
+  VM_BAD_ADDRESS,
+  VM_DIVISION_BY_ZERO,
+  VM_BAD_INPUT
+};
+
+struct VM_ {
+  WORD* stack;      // s[-1] exists too, as scratch for the executors
+  int stackSize;
+  FILE* input;
+  FILE* output;
+
+  // Registers when the machine stopped, for error reports
+  CodeAddress pc;
+  int t;
+  int b;
+
+  long long dispatches;
+};
+
+typedef struct VM_ VM;
+
+// Direct-threaded code, translated from a CodeBlock by translateCode
+struct ThreadedInstruction_ {
+  union {
+    void* handler;     // address of the handler
+    int op;            // or the opcode, in switch dispatch builds
+  };
+  WORD p;
+  WORD q;
+  struct ThreadedInstruction_* target;   // resolved jump or call target
+};
+
+typedef struct ThreadedInstruction_ ThreadedInstruction;
+
+struct ThreadedCode_ {
+  ThreadedInstruction* code;
+  int codeSize;
+  CodeAddress entry;
+  int cacheTop;     // translated for the executor that caches s[t]
+};
+
+typedef struct ThreadedCode_ ThreadedCode;
+
+VM* createVM(int stackSize);
+void freeVM(VM* vm);
+
+// Checks opcodes and jump targets once, so that dispatch does not have to
+int checkCode(CodeBlock* codeBlock);
+enum VMStatus runCode(VM* vm, CodeBlock* codeBlock);
+
+// Returns NULL if the code does not pass checkCode or memory runs out.
+// With cacheTop the code runs with the top of the stack in a register.
+ThreadedCode* translateCode(CodeBlock* codeBlock, int cacheTop);
+void freeThreadedCode(ThreadedCode* threadedCode);
+enum VMStatus runThreaded(VM* vm, ThreadedCode* threadedCode);
+char* vmStatusMessage(enum VMStatus status);
+// The dispatch method this interpreter was built with
+char* vmDispatchMethod(void);
+
+#endif
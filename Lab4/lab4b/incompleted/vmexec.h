@@ -0,0 +1,339 @@
+/*
+ * @copyright (c) 2008, Hedspi, Hanoi University of Technology
+ * @author Huu-Duc Nguyen
+ * @version 1.0
+ */
+
+/* Executor template, included by vm.c once for each executor. The
+ * includer defines
+ *   EXEC_NAME      the name of the function
+ *   EXEC_THREADED  to run ThreadedCode rather than an Instruction[]
+ *   EXEC_CACHED    to keep the top of the stack in a local variable
+ *   EXEC_HANDLERS  for threaded executors, where to publish the handlers
+ * The handlers are written once against the operand, jump and stack
+ * macros below, so every executor runs the same semantics.
+ */
+
+#ifdef EXEC_THREADED
+#define EXEC_CODE ThreadedCode
+#define EXEC_INSTRUCTION ThreadedInstruction
+#define TARGET() (inst->target)
+#else
+#define EXEC_CODE CodeBlock
+#define EXEC_INSTRUCTION Instruction
+#define TARGET() (code + inst->q)
+#endif
+
+// Both forms keep instruction indices, so return addresses are indices
+#define ADDRESS_OF(i) ((i) - code)
+
+#define P (inst->p)
+#define Q (inst->q)
+
+/* With EXEC_CACHED the top of the stack, s[t], lives in tos, and the
+ * memory slot s[t] is stale. Everything else is in memory, so handlers
+ * that move t or read memory by address write tos back (FLUSH) before,
+ * and read it again (RELOAD) after. The slot below the stack (s[-1])
+ * exists, so t = -1 needs no special case. */
+#ifdef EXEC_CACHED
+#define TOS tos
+#define FLUSH() (s[t] = tos)
+#define RELOAD() (tos = s[t])
+#define PUSH(v) do { s[t] = tos; tos = (v); t ++; } while (0)
+#define POP_TO(x) do { (x) = tos; t --; tos = s[t]; } while (0)
+#define DROP(n) do { t -= (n); tos = s[t]; } while (0)
+#define BINARY(f) do { NEED(2); tos = f(s[t - 1], tos); t --; } while (0)
+#else
+#define TOS s[t]
+#define FLUSH() ((void) 0)
+#define RELOAD() ((void) 0)
+#define PUSH(v) do { s[t + 1] = (v); t ++; } while (0)
+#define POP_TO(x) do { (x) = s[t]; t --; } while (0)
+#define DROP(n) (t -= (n))
+#define BINARY(f) do { NEED(2); s[t - 1] = f(s[t - 1], s[t]); t --; } while (0)
+#endif
+#define NOS s[t - 1]
+#define BRANCH(f) do { NEED(2); if (f(NOS, TOS)) pc = TARGET(); DROP(2); } while (0)
+
+#ifdef VM_SWITCH_DISPATCH
+#define DISPATCH() for (;;) switch (dispatches ++, (int) (inst = pc ++)->op)
+#define CASE(op) case op:
+#define NEXT() break
+#else
+#define DISPATCH() NEXT();
+#define CASE(op) L_##op:
+#ifdef EXEC_THREADED
+#define NEXT() do { dispatches ++; inst = pc ++; goto *inst->handler; } while (0)
+#else
+#define NEXT() do { dispatches ++; inst = pc ++; goto *labels[inst->op]; } while (0)
+#endif
+#endif
+
+enum VMStatus EXEC_NAME(VM* vm, EXEC_CODE* prog) {
+#ifndef VM_SWITCH_DISPATCH
+  static void* labels[NUM_OF_HANDLERS] = {
+    [OP_LA] = &&L_OP_LA, [OP_LV] = &&L_OP_LV, [OP_LC] = &&L_OP_LC, [OP_LI] = &&L_OP_LI,
+    [OP_INT] = &&L_OP_INT, [OP_DCT] = &&L_OP_DCT, [OP_J] = &&L_OP_J, [OP_FJ] = &&L_OP_FJ,
+    [OP_HL] = &&L_OP_HL, [OP_ST] = &&L_OP_ST, [OP_CALL] = &&L_OP_CALL, [OP_EP] = &&L_OP_EP,
+    [OP_EF] = &&L_OP_EF, [OP_RC] = &&L_OP_RC, [OP_RI] = &&L_OP_RI, [OP_WRC] = &&L_OP_WRC,
+    [OP_WRI] = &&L_OP_WRI, [OP_WLN] = &&L_OP_WLN, [OP_AD] = &&L_OP_AD, [OP_SB] = &&L_OP_SB,
+    [OP_ML] = &&L_OP_ML, [OP_DV] = &&L_OP_DV, [OP_NEG] = &&L_OP_NEG, [OP_CV] = &&L_OP_CV,
+    [OP_EQ] = &&L_OP_EQ, [OP_NE] = &&L_OP_NE, [OP_GT] = &&L_OP_GT, [OP_LT] = &&L_OP_LT,
+    [OP_GE] = &&L_OP_GE, [OP_LE] = &&L_OP_LE, 
+    [OP_ADI] = &&L_OP_ADI, [OP_LV2] = &&L_OP_LV2, [OP_LVI] = &&L_OP_LVI, [OP_STV] = &&L_OP_STV,
+    [OP_INC] = &&L_OP_INC, [OP_INCL] = &&L_OP_INCL, 
+    [OP_JEQ] = &&L_OP_JEQ, [OP_JNE] = &&L_OP_JNE, [OP_JGT] = &&L_OP_JGT, [OP_JLT] = &&L_OP_JLT,
+    [OP_JGE] = &&L_OP_JGE, [OP_JLE] = &&L_OP_JLE, [OP_FORI] = &&L_OP_FORI, [OP_FORN] = &&L_OP_FORN,
+    [OP_SHL] = &&L_OP_SHL, [OP_SHR] = &&L_OP_SHR, [OP_DVM] = &&L_OP_DVM, 
+    [OP_LAD] = &&L_OP_LAD, [OP_LVD] = &&L_OP_LVD, [OP_DSP] = &&L_OP_DSP, [OP_DRS] = &&L_OP_DRS,
+    [OP_IXA] = &&L_OP_IXA, [OP_LIX] = &&L_OP_LIX, [OP_LVC] = &&L_OP_LVC,
+    [OP_BP] = &&L_OP_BP,
+    [XOP_LA_LOCAL] = &&L_XOP_LA_LOCAL, [XOP_LV_LOCAL] = &&L_XOP_LV_LOCAL
+  };
+#endif
+  EXEC_INSTRUCTION* code;
+  EXEC_INSTRUCTION* pc;
+  EXEC_INSTRUCTION* inst;
+  WORD* s;
+  int stackSize, codeSize;
+  int t = -1, b = 0, a;
+  int input;   // apart from a, whose address is never taken
+  WORD display[DISPLAY_SIZE];   // level 0 is the program's frame, DSP sets the others
+#ifdef EXEC_CACHED
+  WORD tos = 0;
+#endif
+  long long dispatches = 0;
+  enum VMStatus status = VM_HALTED;
+
+#if defined(EXEC_THREADED) && !defined(VM_SWITCH_DISPATCH)
+  // Translation asks for the handler addresses with a null program
+  if (prog == NULL) {
+    EXEC_HANDLERS = labels;
+    return VM_HALTED;
+  }
+#endif
+
+  code = prog->code;
+  codeSize = prog->codeSize;
+  s = vm->stack;
+  stackSize = vm->stackSize;
+  pc = code + prog->entry;
+  inst = pc;
+  display[0] = 0;
+
+  DISPATCH() {
+    CASE(OP_LA)
+      ROOM(1); BASE(P, a);
+      PUSH(a + Q);
+      NEXT();
+    CASE(XOP_LA_LOCAL)
+      ROOM(1); PUSH(b + Q);
+      NEXT();
+    CASE(OP_LV)
+      ROOM(1); BASE(P, a); a += Q; CHECK_ADDRESS(a);
+      PUSH(s[a]);
+      NEXT();
+    CASE(XOP_LV_LOCAL)
+      ROOM(1); a = b + Q; CHECK_ADDRESS(a);
+      PUSH(s[a]);
+      NEXT();
+    CASE(OP_LC)
+      ROOM(1); PUSH(Q);
+      NEXT();
+    CASE(OP_LI)
+      NEED(1); CHECK_ADDRESS(TOS); FLUSH(); TOS = s[TOS];
+      NEXT();
+    CASE(OP_INT)
+      FLUSH(); t += Q;
+      if (t >= stackSize) goto stackOverflow;
+      if (t < -1) goto badAddress;
+      RELOAD();
+      NEXT();
+    CASE(OP_DCT)
+      FLUSH(); t -= Q;
+      if (t >= stackSize) goto stackOverflow;
+      if (t < -1) goto badAddress;
+      RELOAD();
+      NEXT();
+    CASE(OP_J)
+      pc = TARGET();
+      NEXT();
+    CASE(OP_FJ)
+      NEED(1); POP_TO(a);
+      if (a == 0) pc = TARGET();
+      NEXT();
+    CASE(OP_HL)
+      goto halt;
+    CASE(OP_ST)
+      NEED(2); CHECK_ADDRESS(NOS);
+      s[NOS] = TOS; DROP(2);
+      NEXT();
+    CASE(OP_CALL)
+      ROOM(4); BASE(P, a); FLUSH();
+      s[t + 2] = b; s[t + 3] = ADDRESS_OF(pc); s[t + 4] = a;
+      b = t + 1; pc = TARGET();
+      NEXT();
+    CASE(OP_EP)
+      CHECK_ADDRESS(b + 2); CHECK_RETURN(s[b + 2]);
+      t = b - 1; pc = code + s[b + 2]; b = s[b + 1]; RELOAD();
+      NEXT();
+    CASE(OP_EF)
+      CHECK_ADDRESS(b + 2); CHECK_RETURN(s[b + 2]);
+      t = b; pc = code + s[b + 2]; b = s[b + 1]; RELOAD();
+      NEXT();
+    CASE(OP_RC)
+      ROOM(1);
+      if ((a = getc(vm->input)) == EOF) goto badInput;
+      PUSH(a);
+      NEXT();
+    CASE(OP_RI)
+      ROOM(1);
+      if (fscanf(vm->input, "%d", &input) != 1) goto badInput;
+      PUSH(input);
+      NEXT();
+    CASE(OP_WRC)
+      NEED(1); POP_TO(a); putc(a, vm->output);
+      NEXT();
+    CASE(OP_WRI)
+      NEED(1); POP_TO(a); fprintf(vm->output, "%d", a);
+      NEXT();
+    CASE(OP_WLN)
+      putc('\n', vm->output);
+      NEXT();
+    CASE(OP_AD) BINARY(ADD); NEXT();
+    CASE(OP_SB) BINARY(SUB); NEXT();
+    CASE(OP_ML) BINARY(MUL); NEXT();
+    CASE(OP_DV)
+      NEED(2);
+      if (TOS == 0) goto divisionByZero;
+      BINARY(DIV);
+      NEXT();
+    CASE(OP_NEG)
+      NEED(1); TOS = NEGATE(TOS);
+      NEXT();
+    CASE(OP_CV)
+      NEED(1); ROOM(1); PUSH(TOS);
+      NEXT();
+    CASE(OP_EQ) BINARY(EQ); NEXT();
+    CASE(OP_NE) BINARY(NE); NEXT();
+    CASE(OP_GT) BINARY(GT); NEXT();
+    CASE(OP_LT) BINARY(LT); NEXT();
+    CASE(OP_GE) BINARY(GE); NEXT();
+    CASE(OP_LE) BINARY(LE); NEXT();
+    CASE(OP_ADI)
+      NEED(1); TOS = ADD(TOS, Q);
+      NEXT();
+    CASE(OP_LV2)
+      ROOM(2); 
+      a = b + P; CHECK_ADDRESS(a); PUSH(s[a]);
+      a = b + Q; CHECK_ADDRESS(a); PUSH(s[a]);
+      NEXT();
+    CASE(OP_LVI)
+      ROOM(1); BASE(P, a); a += Q; CHECK_ADDRESS(a);
+      FLUSH(); a = s[a]; CHECK_ADDRESS(a);
+      PUSH(s[a]);
+      NEXT();
+    CASE(OP_STV)
+      NEED(1); BASE(P, a); a += Q; CHECK_ADDRESS(a);
+      s[a] = TOS; DROP(1);
+      NEXT();
+    CASE(OP_INC)
+      NEED(1); a = TOS; CHECK_ADDRESS(a);
+      FLUSH(); s[a] = ADD(s[a], Q); RELOAD();
+      NEXT();
+    CASE(OP_INCL)
+      a = b + P; CHECK_ADDRESS(a);
+      FLUSH(); s[a] = ADD(s[a], Q); RELOAD();
+      NEXT();
+    CASE(OP_JEQ) BRANCH(EQ); NEXT();
+    CASE(OP_JNE) BRANCH(NE); NEXT();
+    CASE(OP_JGT) BRANCH(GT); NEXT();
+    CASE(OP_JLT) BRANCH(LT); NEXT();
+    CASE(OP_JGE) BRANCH(GE); NEXT();
+    CASE(OP_JLE) BRANCH(LE); NEXT();
+    CASE(OP_FORI)
+      NEED(2); a = NOS; CHECK_ADDRESS(a);
+      FLUSH();
+      if (s[a] > TOS) {
+	DROP(2); pc = TARGET();
+      }
+      NEXT();
+    CASE(OP_FORN)
+      NEED(2); a = NOS; CHECK_ADDRESS(a);
+      FLUSH(); s[a] = ADD(s[a], 1); RELOAD();
+      if (s[a] <= TOS) pc = TARGET();
+      else DROP(2);
+      NEXT();
+    CASE(OP_SHL)
+      NEED(1); TOS = SHIFT_LEFT(TOS, Q);
+      NEXT();
+    CASE(OP_SHR)
+      NEED(1); TOS = SHIFT_RIGHT(TOS, Q);
+      NEXT();
+    CASE(OP_DVM)
+      NEED(1); TOS = MAGIC_DIVIDE(TOS, Q, P);
+      NEXT();
+    CASE(OP_LAD)
+      ROOM(1); PUSH(display[P] + Q);
+      NEXT();
+    CASE(OP_LVD)
+      ROOM(1); a = display[P] + Q; CHECK_ADDRESS(a);
+      PUSH(s[a]);
+      NEXT();
+    CASE(OP_DSP)
+      CHECK_ADDRESS(b + 3);
+      FLUSH(); s[b + 3] = display[P]; display[P] = b; RELOAD();
+      NEXT();
+    CASE(OP_DRS)
+      CHECK_ADDRESS(b + 3);
+      FLUSH(); display[P] = s[b + 3];
+      NEXT();
+    CASE(OP_IXA)
+      NEED(2); a = ADD(NOS, MUL(TOS, Q));
+      DROP(1); TOS = a;
+      NEXT();
+    CASE(OP_LIX)
+      NEED(2); a = ADD(NOS, MUL(TOS, Q)); CHECK_ADDRESS(a);
+      DROP(1); FLUSH(); TOS = s[a];
+      NEXT();
+    CASE(OP_LVC)
+      ROOM(2); a = b + P; CHECK_ADDRESS(a);
+      PUSH(s[a]); PUSH(Q);
+      NEXT();
+    CASE(OP_BP)
+      NEXT();
+  }
+
+ stackOverflow: status = VM_STACK_OVERFLOW; goto halt;
+ badAddress: status = VM_BAD_ADDRESS; goto halt;
+ divisionByZero: status = VM_DIVISION_BY_ZERO; goto halt;
+ badInput: status = VM_BAD_INPUT; goto halt;
+
+ halt:
+  if (t >= 0 && t < stackSize) FLUSH();
+  vm->pc = ADDRESS_OF(inst);
+  vm->t = t;
+  vm->b = b;
+  vm->dispatches = dispatches;
+  fflush(vm->output);
+  return status;
+}
+
+#undef EXEC_CODE
+#undef EXEC_INSTRUCTION
+#undef TARGET
+#undef ADDRESS_OF
+#undef P
+#undef Q
+#undef TOS
+#undef NOS
+#undef FLUSH
+#undef RELOAD
+#undef PUSH
+#undef POP_TO
+#undef DROP
+#undef BINARY
+#undef BRANCH
+#undef DISPATCH
+#undef CASE
+#undef NEXT